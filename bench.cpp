@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <random>
+#include <signal.h>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "connection.h"
+#include "netem.h"
+#include "packet.h"
+#include "udp-util.h"
+
+/// Benchmark harness: runs the server and the client in-process over loopback
+/// for every combination of the swept parameters and prints one CSV or JSON
+/// record per point with the median of the repeated runs.
+///
+/// Usage: bench [--csv|--json] [--repeat N] [--timeout SEC] [--payload LIST]
+///              [--mode LIST] [--window LIST] [--plp LIST] [--rtt LIST] [--size LIST]
+///              [--netem SPEC] [--memory] [--busy-poll USEC]
+/// where LIST is comma separated, e.g. --mode sr,gbn --window 2500,100000 --rtt 0,10
+/// Without --mode a window < 1 selects stop-and-wait and any other window
+/// selective repeat, like server.in does. rtt is in milliseconds and split
+/// evenly between both directions, plp only drops data packets (never the
+/// file size reply, see sender::send_first_ack()). SPEC is
+/// applied to both directions, see udp_util::parse_netem(). --memory sends
+/// between two connections' memory buffers, without the file request and
+/// without any file I/O. --busy-poll makes both ends poll their sockets, see
+/// udp_util::set_busy_poll(), and the CPU time then includes the spinning.
+/// Every run happens in a child process that is killed after --timeout SEC
+/// (default 60), the run then counts as a failure and a timeout.
+
+using namespace std;
+
+const long HANDSHAKE_TIME_OUT = 999999;
+
+struct point {
+    arq_mode mode;
+    int payload;
+    int window;
+    double plp;
+    double rtt_ms;
+    int64_t size;
+};
+
+struct run_result {
+    bool ok;
+    bool timed_out;
+    double completion_s;
+    double cpu_s;
+};
+
+struct options {
+    bool json = false;
+    bool memory = false;
+    int repeat = 3;
+    int timeout_s = 60;
+    vector<string> modes = {""};
+    vector<double> payloads = {200};
+    vector<double> windows = {0, 100000};
+    vector<double> plps = {0, 0.01};
+    vector<double> rtts = {0};
+    vector<double> sizes = {1000000};
+    udp_util::netem_config netem;
+    int busy_poll_us = 0;
+};
+
+double now_sec(clockid_t clock = CLOCK_MONOTONIC) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_sec(const int who) {
+    rusage ru;
+    getrusage(who, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int local_port(const int sockfd) {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(sockfd, (sockaddr*) &addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+rudp::options connection_options(const options& bench_opt, const point& p) {
+    rudp::options opt;
+    opt.mode = p.mode;
+    opt.window = p.window;
+    opt.payload_size = p.payload;
+    opt.busy_poll_us = bench_opt.busy_poll_us;
+    return opt;
+}
+
+void serve_one(udp_util::udpsocket* listener, const string& path, const rudp::options& opt,
+               const udp_util::netem_config& netem) {
+    char filename[256];
+    int recv_bytes = -1;
+    for (int i = 0; i < 10 && recv_bytes < 0; ++i) {
+        recv_bytes = udp_util::recvtimed(listener, filename, sizeof(filename), HANDSHAKE_TIME_OUT);
+    }
+    if (recv_bytes < 0) {
+        return;
+    }
+    rudp::connection conn(udp_util::create_socket(listener->toaddr, listener->addr_len), opt);
+    udp_util::attach_netem(conn.socket(), netem, 1, udp_util::SERVER_SIDE);
+    rudp::send_file(&conn, path.c_str());
+}
+
+void serve_memory(rudp::connection* conn, const vector<char>* data) {
+    conn->send(data->data(), data->size());
+}
+
+bool same_content(const string& a, const string& b) {
+    FILE* fa = fopen(a.c_str(), "rb");
+    FILE* fb = fopen(b.c_str(), "rb");
+    bool same = fa != NULL && fb != NULL;
+    char ba[65536], bb[65536];
+    while (same) {
+        size_t na = fread(ba, 1, sizeof(ba), fa);
+        size_t nb = fread(bb, 1, sizeof(bb), fb);
+        same = na == nb && !memcmp(ba, bb, na);
+        if (na == 0) break;
+    }
+    if (fa != NULL) fclose(fa);
+    if (fb != NULL) fclose(fb);
+    return same;
+}
+
+run_result run_once(const options& opt, const point& p, const string& src, const string& dst, const int seed) {
+    /* The emulator threads are part of the measured CPU time */
+    udp_util::netem_config client_netem = opt.netem;
+    client_netem.delay_us += p.rtt_ms * 500;
+    client_netem.seed = seed;
+    udp_util::netem_config server_netem = client_netem;
+    if (p.plp > 0) {
+        server_netem.loss_good = p.plp;
+    }
+
+    udp_util::udpsocket listener = udp_util::create_socket(0);
+    rudp::connection client(udp_util::create_socket(0, local_port(listener.fd), INADDR_LOOPBACK),
+                            connection_options(opt, p));
+    udp_util::attach_netem(client.socket(), client_netem, 1, udp_util::CLIENT_SIDE);
+
+    double cpu_start = cpu_sec(RUSAGE_SELF);
+    double start = now_sec();
+    rudp::options server_opt = connection_options(opt, p);
+    thread server(serve_one, &listener, src, cref(server_opt), cref(server_netem));
+
+    int64_t received = -1;
+    int64_t filesize = rudp::request_file(&client, "bench");
+    if (filesize == p.size) {
+        received = rudp::receive_file(&client, dst.c_str(), filesize);
+    }
+    run_result r;
+    r.timed_out = false;
+    r.completion_s = now_sec() - start;
+    server.join();
+
+    r.cpu_s = cpu_sec(RUSAGE_SELF) - cpu_start;
+    r.ok = received == p.size && same_content(src, dst);
+    close(listener.fd);
+    return r;
+}
+
+run_result run_memory(const options& opt, const point& p, const vector<char>& data, const int seed) {
+    udp_util::netem_config client_netem = opt.netem;
+    client_netem.delay_us += p.rtt_ms * 500;
+    client_netem.seed = seed;
+    udp_util::netem_config server_netem = client_netem;
+    if (p.plp > 0) {
+        server_netem.loss_good = p.plp;
+    }
+
+    rudp::connection server(udp_util::create_socket(0, 0, INADDR_LOOPBACK), connection_options(opt, p));
+    rudp::connection client(udp_util::create_socket(0, local_port(server.socket()->fd), INADDR_LOOPBACK),
+                            connection_options(opt, p));
+    server.socket()->toaddr.sin_port = htons(local_port(client.socket()->fd));
+    udp_util::attach_netem(server.socket(), server_netem, 1, udp_util::SERVER_SIDE);
+    udp_util::attach_netem(client.socket(), client_netem, 1, udp_util::CLIENT_SIDE);
+    vector<char> received(data.size());
+
+    double cpu_start = cpu_sec(RUSAGE_SELF);
+    double start = now_sec();
+    thread writer(serve_memory, &server, &data);
+    int64_t n = client.receive(received.data(), received.size());
+    run_result r;
+    r.timed_out = false;
+    r.completion_s = now_sec() - start;
+    writer.join();
+
+    r.cpu_s = cpu_sec(RUSAGE_SELF) - cpu_start;
+    r.ok = n == p.size && received == data;
+    return r;
+}
+
+/// Run in a child process and kill it after opt.timeout_s, a stuck transfer
+/// cannot be cancelled in-process. A run that times out or crashes fails
+run_result run_isolated(const options& opt, const function<run_result()>& run) {
+    run_result r = {false, false, 0, 0};
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("bench: cannot create pipe");
+        return r;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        r = run();
+        _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    pollfd pfd = {fds[0], POLLIN, 0};
+    if (pid < 0) {
+        perror("bench: cannot fork");
+    } else if (poll(&pfd, 1, opt.timeout_s * 1000) > 0) {
+        if (read(fds[0], &r, sizeof(r)) != sizeof(r)) {
+            r.ok = false;
+        }
+    } else {
+        cerr << "bench: run timed out after " << opt.timeout_s << " s" << endl;
+        kill(pid, SIGKILL);
+        r.timed_out = true;
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+    close(fds[0]);
+    return r;
+}
+
+vector<char> make_data(const int64_t size) {
+    mt19937 gen(size);
+    vector<char> data(size);
+    for (char& c : data) c = gen();
+    return data;
+}
+
+string make_file(const string& dir, const int64_t size) {
+    string path = dir + "/src-" + to_string(size);
+    if (access(path.c_str(), F_OK) == 0) {
+        return path;
+    }
+    FILE* fd = fopen(path.c_str(), "wb");
+    mt19937 gen(size);
+    vector<char> buf(65536);
+    for (int64_t left = size; left > 0; left -= buf.size()) {
+        for (char& c : buf) c = gen();
+        fwrite(buf.data(), 1, min<int64_t>(left, buf.size()), fd);
+    }
+    fclose(fd);
+    return path;
+}
+
+double median(vector<double> v) {
+    sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[v.size() / 2];
+}
+
+void print_point(const options& opt, const point& p, const vector<run_result>& runs, const bool first) {
+    vector<double> completion, cpu;
+    int failures = 0, timeouts = 0;
+    for (const run_result& r : runs) {
+        if (r.ok) {
+            completion.push_back(r.completion_s);
+            cpu.push_back(r.cpu_s);
+        } else {
+            failures++;
+            timeouts += r.timed_out;
+        }
+    }
+    double c = median(completion);
+    double c_min = completion.empty() ? 0 : *min_element(completion.begin(), completion.end());
+    double c_max = completion.empty() ? 0 : *max_element(completion.begin(), completion.end());
+    double throughput = c > 0 ? p.size / c : 0;
+    double cpu_ns_per_byte = p.size > 0 ? median(cpu) / p.size * 1e9 : 0;
+    const char* mode = mode_name(p.mode);
+
+    if (opt.json) {
+        printf("%s  {\"mode\":\"%s\",\"payload\":%d,\"window\":%d,\"plp\":%g,\"rtt_ms\":%g,\"size\":%ld,"
+               "\"runs\":%d,\"failures\":%d,\"timeouts\":%d,\"completion_s\":{\"median\":%.6f,\"min\":%.6f,\"max\":%.6f},"
+               "\"throughput_Bps\":%.0f,\"cpu_ns_per_byte\":%.3f}",
+               first ? "" : ",\n", mode, p.payload, p.window, p.plp, p.rtt_ms, (long) p.size,
+               (int) runs.size(), failures, timeouts, c, c_min, c_max, throughput, cpu_ns_per_byte);
+    } else {
+        printf("%s,%d,%d,%g,%g,%ld,%d,%d,%d,%.6f,%.6f,%.6f,%.0f,%.3f\n", mode, p.payload, p.window, p.plp,
+               p.rtt_ms, (long) p.size, (int) runs.size(), failures, timeouts, c, c_min, c_max, throughput,
+               cpu_ns_per_byte);
+    }
+    fflush(stdout);
+}
+
+vector<string> split_list(const char* s) {
+    vector<string> v;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) {
+        v.push_back(item);
+    }
+    return v;
+}
+
+vector<double> parse_list(const char* s) {
+    vector<double> v;
+    for (const string& item : split_list(s)) {
+        v.push_back(atof(item.c_str()));
+    }
+    return v;
+}
+
+bool valid_modes(const vector<string>& modes) {
+    arq_mode mode;
+    for (const string& m : modes) {
+        if (!parse_mode(m.c_str(), 0, &mode)) {
+            return false;
+        }
+    }
+    return !modes.empty();
+}
+
+int main(int argc, char* argv[]) {
+    options opt;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--json") opt.json = true;
+        else if (arg == "--csv") opt.json = false;
+        else if (arg == "--memory") opt.memory = true;
+        else if (arg == "--repeat" && has_value) opt.repeat = max(1, atoi(argv[++i]));
+        else if (arg == "--timeout" && has_value) opt.timeout_s = max(1, atoi(argv[++i]));
+        else if (arg == "--mode" && has_value && valid_modes(opt.modes = split_list(argv[++i])));
+        else if (arg == "--payload" && has_value) opt.payloads = parse_list(argv[++i]);
+        else if (arg == "--window" && has_value) opt.windows = parse_list(argv[++i]);
+        else if (arg == "--plp" && has_value) opt.plps = parse_list(argv[++i]);
+        else if (arg == "--rtt" && has_value) opt.rtts = parse_list(argv[++i]);
+        else if (arg == "--size" && has_value) opt.sizes = parse_list(argv[++i]);
+        else if (arg == "--netem" && has_value && udp_util::parse_netem(argv[++i], &opt.netem));
+        else if (arg == "--busy-poll" && has_value) opt.busy_poll_us = max(0, atoi(argv[++i]));
+        else {
+            cerr << "Usage: " << argv[0] << " [--csv|--json] [--repeat N] [--timeout SEC] [--payload LIST]"
+                 << " [--mode LIST] [--window LIST] [--plp LIST] [--rtt LIST] [--size LIST] [--netem SPEC]"
+                 << " [--memory] [--busy-poll USEC]" << endl;
+            return -1;
+        }
+    }
+
+    char dir_template[] = "/tmp/rudp-bench.XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+        perror("bench: cannot create work directory");
+        return -1;
+    }
+    string dir = dir_template;
+
+    /* Silence the transfer progress messages, results go to stdout */
+    stringstream discard;
+    streambuf* cout_buf = cout.rdbuf(discard.rdbuf());
+
+    if (opt.json) {
+        printf("{\"points\":[\n");
+    } else {
+        printf("mode,payload,window,plp,rtt_ms,size,runs,failures,timeouts,completion_s_median,"
+               "completion_s_min,completion_s_max,throughput_Bps,cpu_ns_per_byte\n");
+    }
+
+    bool first = true;
+    int total_failures = 0;
+    for (double size : opt.sizes)
+    for (const string& mode : opt.modes)
+    for (double payload : opt.payloads)
+    for (double window : opt.windows)
+    for (double plp : opt.plps)
+    for (double rtt : opt.rtts) {
+        point p = {SELECTIVE_REPEAT, (int) payload, (int) window, plp, rtt, (int64_t) size};
+        parse_mode(mode.c_str(), p.window, &p.mode);
+        string src = opt.memory ? "" : make_file(dir, p.size);
+        string dst = dir + "/dst";
+        vector<char> data = opt.memory ? make_data(p.size) : vector<char>();
+        vector<run_result> runs;
+        for (int i = 0; i < opt.repeat; ++i) {
+            runs.push_back(run_isolated(opt, [&]() {
+                return opt.memory ? run_memory(opt, p, data, i + 1) : run_once(opt, p, src, dst, i + 1);
+            }));
+            total_failures += !runs.back().ok;
+            discard.str("");
+        }
+        print_point(opt, p, runs, first);
+        first = false;
+    }
+    if (opt.json) {
+        printf("\n]}\n");
+    }
+
+    cout.rdbuf(cout_buf);
+    if (system(("rm -rf " + dir).c_str()) != 0) {
+        cerr << "bench: cannot remove " << dir << endl;
+    }
+    return total_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+#include "connection.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "netem.h"
+#include "receiver.h"
+#include "sender.h"
+
+using namespace std;
+
+namespace rudp {
+
+connection::connection(const udp_util::udpsocket& s, const options& o) : sock(s), opt(o) {
+    /* A window in flight is the bandwidth-delay product, all of it may land in
+       the receive buffer while the receiver is busy with the sink */
+    int payload_size = max(1, min(opt.payload_size, MAX_PAYLOAD_SIZE));
+    int datagrams = udp_util::size_buffers(&sock, max(opt.window, payload_size) / payload_size + 1,
+                                           PCKT_HEADER_SIZE + payload_size);
+    int64_t room = (int64_t) max(datagrams, 1) * payload_size;
+    recv_window = opt.window > 0 ? min<int64_t>(opt.window, room) : room;
+    if (opt.busy_poll_us > 0) {
+        udp_util::set_busy_poll(&sock, opt.busy_poll_us);
+    }
+    stats::reset(&st, &sock);
+}
+
+connection::~connection() {
+    udp_util::detach_netem(&sock);
+    close(sock.fd);
+}
+
+int64_t connection::send(const source& src, const int64_t size) {
+    int64_t sent = sender::send(&sock, src, send_offset, size, opt, &st);
+    if (sent > 0) {
+        send_offset += sent;
+    }
+    return sent;
+}
+
+int64_t connection::send(const void* buf, const int64_t size) {
+    const char* data = (const char*) buf;
+    return send([data](char* to, uint64_t offset, int len) {
+        memcpy(to, data + offset, len);
+        return len;
+    }, size);
+}
+
+int64_t connection::receive(const sink& dst, const int64_t size) {
+    options o = opt;
+    o.window = recv_window;
+    int64_t received = receiver::receive(&sock, dst, recv_offset, size, o, &st);
+    recv_offset += received;
+    return received;
+}
+
+int64_t connection::receive(void* buf, const int64_t size) {
+    char* data = (char*) buf;
+    return receive([data](const char* from, uint64_t offset, int len) {
+        memcpy(data + offset, from, len);
+        return true;
+    }, size);
+}
+
+int64_t find_file_size(FILE* fd) {
+    fseeko(fd, 0L, SEEK_END);
+    int64_t size = ftello(fd);
+    fseeko(fd, 0L, SEEK_SET);
+    return size;
+}
+
+source file_source(FILE* fd) {
+    int file_fd = fileno(fd);
+    return [file_fd](char* buf, uint64_t offset, int len) {
+        return (int) pread(file_fd, buf, len, offset);
+    };
+}
+
+int64_t send_file(connection* conn, const char* file_name) {
+    FILE* fd = fopen(file_name, "r");
+    if (fd == NULL) {
+        cerr << "File " << file_name << " NOT FOUND 404" << endl;
+        perror("server: ");
+        sender::send_first_ack(conn->socket(), -1);
+        return -1;
+    }
+    int64_t file_size = find_file_size(fd);
+
+    cout << "server: opened file: \"" << file_name << "\"" << endl;
+    cout << "file_size: " << file_size << " bytes" << endl;
+
+    if (!sender::send_first_ack(conn->socket(), file_size)) {
+        fclose(fd);
+        return -1;
+    }
+    int64_t sent = conn->send(file_source(fd), file_size);
+    fclose(fd);
+    return sent;
+}
+
+int64_t request_file(connection* conn, const char* file_name) {
+    return receiver::request_file(conn->socket(), file_name);
+}
+
+int64_t receive_file(connection* conn, const char* file_name, const int64_t filesize) {
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("client: cannot open file");
+        return 0;
+    }
+    int64_t received = conn->receive([fd](const char* buf, uint64_t offset, int len) {
+        return pwrite(fd, buf, len, offset) == len;
+    }, filesize);
+    close(fd);
+    return received;
+}
+
+} // namespace rudp
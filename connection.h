@@ -0,0 +1,100 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <cstdint>
+#include <functional>
+#include <stdio.h>
+
+#include "packet.h"
+#include "stats.h"
+#include "udp-util.h"
+
+/// libreliableudp: reliable transfers over a UDP socket, with all the protocol
+/// state owned by a connection so any number of them can run in one process.
+/// Tracing (trace.h) and the stats exporter (stats::begin) stay process-wide.
+namespace rudp {
+
+/// Copy up to len bytes at offset, counted from the start of the transfer, into buf.
+/// Return the bytes copied, less than len only at the end of the data, or -1 on error.
+typedef std::function<int (char* buf, uint64_t offset, int len)> source;
+
+/// Consume len bytes at offset, counted from the start of the transfer. They come
+/// in order except in fanout mode, where any byte may also come more than once.
+/// Return false to abort.
+typedef std::function<bool (const char* buf, uint64_t offset, int len)> sink;
+
+struct options {
+    arq_mode mode = SELECTIVE_REPEAT;
+    int window = 100000;                        // bytes in flight; receiving, the window advertised to the
+                                                // sender and reassembly buffer for selective repeat;
+                                                // bytes per 10 ms for fanout
+    int payload_size = DEFAULT_PAYLOAD_SIZE;    // bytes of data per packet, at most MAX_PAYLOAD_SIZE
+    int busy_poll_us = 0;                       // > 0: poll the socket instead of sleeping on it, see
+                                                // udp_util::set_busy_poll()
+};
+
+/// One peer over one socket. Transfers are sequential, each one continues the
+/// sequence numbers of the previous one in the same direction so stale
+/// packets are recognized. Both peers must use the same mode. The kernel
+/// buffers of the socket are grown to a window of packets, and the window
+/// advertised to the sender never exceeds what they hold.
+class connection {
+public:
+    /// Takes ownership of sock, the socket is closed with the connection.
+    /// If create_socket() failed every transfer on it fails
+    connection(const udp_util::udpsocket& sock, const options& opt);
+    ~connection();
+
+    /// Send size bytes read from src and wait till the peer has all of them.
+    /// Return size or -1 if the peer stopped answering, src or the socket
+    /// failed, errno set in the last case
+    int64_t send(const source& src, const int64_t size);
+    int64_t send(const void* buf, const int64_t size);
+
+    /// Receive size bytes into dst. Return the number of bytes received,
+    /// less than size if the peer went silent, dst aborted or the socket failed
+    int64_t receive(const sink& dst, const int64_t size);
+    int64_t receive(void* buf, const int64_t size);
+
+    inline udp_util::udpsocket* socket() { return &sock; }
+    inline const options& config() const { return opt; }
+    /// Counters accumulated since the connection was created, or since
+    /// they were last passed to stats::begin or stats::reset
+    inline stats::transfer& counters() { return st; }
+
+private:
+    connection(const connection&);
+    connection& operator=(const connection&);
+
+    udp_util::udpsocket sock;
+    const options opt;
+    int recv_window;                // opt.window, at most what the receive buffer holds
+    uint64_t send_offset = 0;
+    uint64_t recv_offset = 0;
+    stats::transfer st;
+};
+
+/// File service of server and client: the client sends a file name, the
+/// server answers with the file size (-1 if not found) then sends the file.
+/// In fanout mode the server side is fanout::distributor instead.
+
+int64_t find_file_size(FILE* fd);
+
+/// Source reading an open file from its start
+source file_source(FILE* fd);
+
+/// Answer a request for file_name and send the file.
+/// Return number of bytes sent or -1 if error happened
+int64_t send_file(connection* conn, const char* file_name);
+
+/// Keep sending file_name to the server till it answers with the file size
+/// Returns filesize received from the server, -1 if it never answered
+int64_t request_file(connection* conn, const char* file_name);
+
+/// Receive filesize bytes into file_name
+/// Returns number of bytes written
+int64_t receive_file(connection* conn, const char* file_name, const int64_t filesize);
+
+} // namespace rudp
+
+#endif // CONNECTION_H
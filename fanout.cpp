@@ -0,0 +1,393 @@
+#include "fanout.h"
+
+#include <errno.h>
+#include <iostream>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "packet.h"
+#include "sender.h"
+#include "trace.h"
+
+using namespace std;
+
+namespace fanout {
+
+namespace {
+
+const int BATCH = 64;                           // packets per sendmmsg round
+const long PACE_US = 10000;                     // at most opt.window bytes every 10 ms
+const int IDLE_WAIT_MS = 10;                    // feedback wait when there is nothing to send
+const long SUBSCRIBER_TIME_OUT = 5000000;       // 5 sec of silence and a receiver is dropped
+
+mutex print_lock;
+
+long usec_since(const timespec& t) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t.tv_sec) * 1000000 + (now.tv_nsec - t.tv_nsec) / 1000;
+}
+
+bool same_addr(const sockaddr_in& a, const sockaddr_in& b) {
+    return a.sin_port == b.sin_port && a.sin_addr.s_addr == b.sin_addr.s_addr;
+}
+
+} // namespace
+
+session::session(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+                 const rudp::options& opt, stats::transfer* st)
+    :   sock(sock), src(src), start(start), size(size),
+        payload_size(max(1, min(opt.payload_size, MAX_PAYLOAD_SIZE))),
+        pace_window(max(opt.window, payload_size)), st(st) {
+}
+
+bool session::join(const sockaddr_in& addr, const bool announce) {
+    lock_guard<mutex> guard(mtx);
+    if (over) {
+        return false;
+    }
+    if (announce) {
+        udp_util::udpsocket to = *sock;
+        to.toaddr = addr;
+        to.addr_len = sizeof(addr);
+        if (!sender::send_first_ack(&to, size)) {
+            return true;    // it asks again
+        }
+    }
+    for (subscriber& s : subscribers) {
+        if (same_addr(s.addr, addr)) {
+            return true;
+        }
+    }
+    subscriber s;
+    s.addr = addr;
+    s.covered = 0;
+    s.credit = 0;           // till it advertises its window, first thing when it starts receiving
+    s.sent = 0;
+    s.heard = false;
+    s.done = false;
+    clock_gettime(CLOCK_MONOTONIC, &s.last_active);
+    subscribers.push_back(s);
+    return true;
+}
+
+void session::read_feedback(const int timeout_ms) {
+    pollfd pfd = {sock->fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return;
+    }
+    const uint64_t end = start + size;
+    lock_guard<mutex> guard(mtx);
+    ack_packet ack;
+    int recv_bytes;
+    while ((recv_bytes = udp_util::recv_nowait(sock, &ack, sizeof(ack))) >= 0) {
+        const sockaddr_in from = sock->toaddr;
+        if (recv_bytes != sizeof(ack)) {
+            continue;
+        }
+        st->packets_received++;
+        for (subscriber& s : subscribers) {
+            if (!same_addr(s.addr, from)) {
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &s.last_active);
+            s.heard = true;
+            uint64_t seqno = expand_seqno_within(start, end, start + size / 2, ack.ackno);
+            trace::emit(trace::ACK, seqno, ack.len, ack.window);
+            /* Every ACK carries the free space, an empty one below end only that and
+               the last packet read. What was sent after it is on the way or queued */
+            if (ack.len > 0) {
+                /* After a silence, nothing unread is on the way any more */
+                s.unread.clear();
+            } else if (seqno != end) {
+                auto it = s.unread.begin();
+                while (it != s.unread.end() && it->first != ack.ackno) {
+                    ++it;
+                }
+                if (it != s.unread.end()) {
+                    s.unread.erase(s.unread.begin(), it + 1);
+                }
+            }
+            s.credit = (int64_t) ack.window - (int64_t) (s.unread.empty() ? 0 : s.sent - s.unread.front().second);
+            if (ack.len > 0) {
+                s.repairs.insert(max(seqno, start), min(seqno + ack.len, end));
+            } else if (seqno == end) {
+                st->bytes_delivered += s.done ? 0 : size;
+                s.done = true;
+            }
+            break;
+        }
+    }
+}
+
+bool session::fill(packet* pckt, const uint64_t seqno, const int len) {
+    pckt->cksum = 1;
+    pckt->len = len;
+    pckt->seqno = (uint32_t) seqno;
+    if (src(pckt->data, seqno - start, len) != len) {
+        cerr << "server: cannot read data at " << seqno - start << endl;
+        return false;
+    }
+    return true;
+}
+
+void session::account(subscriber* s, const uint64_t seqno, const int len) {
+    s->unread.push_back(make_pair((uint32_t) seqno, s->sent));
+    s->sent += len;
+    s->credit -= len;
+}
+
+int session::run() {
+    /* Receivers get nothing till they advertise a window, which would never come */
+    if (sock->fd < 0) {
+        lock_guard<mutex> guard(mtx);
+        over = true;
+        errno = EBADF;
+        return -1;
+    }
+    const uint64_t end = start + size;
+    vector<packet> pckts(BATCH);
+    vector<udp_util::message> msgs;
+    uint64_t sweep = start;
+    int completed = 0;
+    bool failed = false;
+
+    timespec pace_start;
+    clock_gettime(CLOCK_MONOTONIC, &pace_start);
+    uint64_t paced = 0;
+    st->cwnd = pace_window;
+
+    while (true) {
+        read_feedback(0);
+        msgs.clear();
+        int n = 0, batch_bytes = 0;
+
+        unique_lock<mutex> lock(mtx);
+        for (size_t i = 0; i < subscribers.size();) {
+            subscriber& s = subscribers[i];
+            if (s.done || usec_since(s.last_active) > SUBSCRIBER_TIME_OUT) {
+                if (!s.done) {
+                    cerr << "server: receiver " << inet_ntoa(s.addr.sin_addr) << ":" << ntohs(s.addr.sin_port)
+                         << " went silent" << endl;
+                    silent++;
+                }
+                completed += s.done;
+                subscribers.erase(subscribers.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+        if (subscribers.empty()) {
+            over = true;
+            break;
+        }
+
+        /* Repairs first, one packet per receiver and turn so none starves the others */
+        for (bool more = true; more && !failed && n < BATCH && batch_bytes < pace_window;) {
+            more = false;
+            for (subscriber& s : subscribers) {
+                if (s.repairs.empty() || n == BATCH) {
+                    continue;
+                }
+                Range<uint64_t> r = s.repairs.first();
+                int len = min<uint64_t>(r.len(), payload_size);
+                if (s.credit < len) {
+                    continue;
+                }
+                account(&s, r.start(), len);
+                s.repairs.erase(r.start(), r.start() + len);
+                if (!fill(&pckts[n], r.start(), len)) {
+                    failed = true;
+                    break;
+                }
+                msgs.push_back({&pckts[n], PCKT_HEADER_SIZE + len, s.addr});
+                clock_gettime(CLOCK_MONOTONIC, &s.last_active);
+                st->packets_retransmitted++;
+                trace::emit(trace::RETRANSMIT, r.start(), len);
+                batch_bytes += len;
+                n++;
+                more = true;
+            }
+        }
+
+        /* Then the shared transmission, to every receiver that has not seen all of it,
+           as long as all of them have room for it. One that has not advertised its
+           window yet, or never will, waits for the transmission to wrap around */
+        while (!failed && n < BATCH && batch_bytes < pace_window && size > 0) {
+            int len = min<uint64_t>(payload_size, end - sweep);
+            bool room = true;
+            for (const subscriber& s : subscribers) {
+                room = room && (s.covered >= (uint64_t) size || !s.heard || s.credit >= len);
+            }
+            if (!room) {
+                break;
+            }
+            int receivers = 0;
+            for (subscriber& s : subscribers) {
+                if (s.covered >= (uint64_t) size || !s.heard) {
+                    continue;
+                }
+                if (receivers++ == 0 && !fill(&pckts[n], sweep, len)) {
+                    failed = true;
+                    break;
+                }
+                msgs.push_back({&pckts[n], PCKT_HEADER_SIZE + len, s.addr});
+                s.covered += len;
+                account(&s, sweep, len);
+                clock_gettime(CLOCK_MONOTONIC, &s.last_active);
+            }
+            if (receivers == 0 || failed) {
+                break;
+            }
+            trace::emit(trace::SEND, sweep, len, receivers);
+            batch_bytes += len;
+            n++;
+            sweep = sweep + len == end ? start : sweep + len;
+        }
+        if (failed) {
+            over = true;
+            break;
+        }
+        lock.unlock();
+
+        if (msgs.empty()) {
+            read_feedback(IDLE_WAIT_MS);
+            clock_gettime(CLOCK_MONOTONIC, &pace_start);
+            paced = 0;
+            continue;
+        }
+        if (udp_util::send_batch(sock, msgs.data(), msgs.size()) == -1) {
+            perror("server: error sending pckt!");
+            lock.lock();
+            over = true;
+            return -1;
+        }
+        for (const udp_util::message& m : msgs) {
+            st->packets_sent++;
+            st->bytes_sent += m.len;
+        }
+
+        /* Pace by the bytes of data, however many receivers each packet went to */
+        paced += batch_bytes;
+        long ahead = paced * PACE_US / pace_window - usec_since(pace_start);
+        if (ahead > 0) {
+            usleep(ahead);
+        }
+    }
+    return failed ? -1 : completed;
+}
+
+distributor::distributor(const rudp::options& opt, const udp_util::netem_config& netem)
+    :   opt(opt), netem(netem), completed(0), silent(0) {
+    reaper = thread(&distributor::reap_finished, this);
+}
+
+distributor::~distributor() {
+    mtx.lock();
+    stopping = true;
+    mtx.unlock();
+    reaper_cv.notify_one();
+    reaper.join();
+    /* Without mtx, the transmissions take it to say they are over */
+    reap(true);
+}
+
+size_t distributor::transmissions() {
+    lock_guard<mutex> guard(mtx);
+    return running.size() + retired.size();
+}
+
+void distributor::request(udp_util::udpsocket* listener, const string& file_name) {
+    lock_guard<mutex> guard(mtx);
+    auto it = running.find(file_name);
+    if (it != running.end()) {
+        if (it->second->s->join(listener->toaddr, true)) {
+            cout << "server: joined the transmission of " << file_name << endl;
+            return;
+        }
+        retired.push_back(it->second);
+        running.erase(it);
+    }
+
+    FILE* fd = fopen(file_name.c_str(), "r");
+    if (fd == NULL) {
+        cerr << "File " << file_name << " NOT FOUND 404" << endl;
+        sender::send_first_ack(listener, -1);
+        return;
+    }
+    transmission* t = new transmission();
+    t->sock = udp_util::create_socket(0);
+    if (t->sock.fd < 0) {
+        fclose(fd);
+        delete t;
+        return;
+    }
+    /* Room for a pacing round: up to a window of data, to each receiver in turn */
+    int payload_size = max(1, min(opt.payload_size, MAX_PAYLOAD_SIZE));
+    udp_util::size_buffers(&t->sock, max(opt.window, payload_size) / payload_size + 1, PCKT_HEADER_SIZE + payload_size);
+    udp_util::attach_netem(&t->sock, netem, ntohs(listener->toaddr.sin_port), udp_util::SERVER_SIDE);
+    t->fd = fd;
+    stats::reset(&t->st, &t->sock);
+    t->finished = false;
+    t->s = new session(&t->sock, rudp::file_source(fd), 0, rudp::find_file_size(fd), opt, &t->st);
+    t->s->join(listener->toaddr, true);
+    running[file_name] = t;
+    t->worker = thread(&distributor::run, this, t, file_name);
+    cout << "server: started a transmission of " << file_name << endl;
+}
+
+void distributor::run(transmission* t, const string file_name) {
+    int receivers = t->s->run();
+    lock_guard<mutex> guard(print_lock);
+    cout << "Sent " << file_name << " to " << receivers << " receivers, "
+         << t->s->went_silent() << " went silent" << endl;
+    completed += max(receivers, 0);
+    silent += t->s->went_silent();
+    /* Sessions run side by side, none of them is the exported transfer */
+    stats::poll_drops(&t->st, &t->sock);
+    stats::summarize(t->st, cout, "server");
+    cout.flush();
+    mtx.lock();
+    t->finished = true;
+    mtx.unlock();
+    reaper_cv.notify_one();
+}
+
+/// Free every transmission as soon as it is over, not when the next request comes
+void distributor::reap_finished() {
+    unique_lock<mutex> lock(mtx);
+    while (!stopping) {
+        reap(false);
+        reaper_cv.wait(lock);
+    }
+}
+
+/// Join and free the transmissions that are over, or all of them
+void distributor::reap(const bool all) {
+    for (auto it = running.begin(); it != running.end();) {
+        if (all || it->second->finished) {
+            retired.push_back(it->second);
+            it = running.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = retired.begin(); it != retired.end();) {
+        transmission* t = *it;
+        if (!all && !t->finished) {
+            ++it;   // no more joins, still sending
+            continue;
+        }
+        t->worker.join();
+        delete t->s;
+        udp_util::detach_netem(&t->sock);
+        close(t->sock.fd);
+        fclose(t->fd);
+        delete t;
+        it = retired.erase(it);
+    }
+}
+
+} // namespace fanout
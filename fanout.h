@@ -0,0 +1,136 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "connection.h"
+#include "netem.h"
+#include "stats.h"
+#include "udp-util.h"
+#include "util.h"
+
+/// One-to-many distribution. A session sends the data once, paced, and fans
+/// every packet out with sendmmsg to all the receivers that joined it. A late
+/// receiver gets the part it missed when the transmission wraps around, as
+/// does one that has not advertised its window yet, and
+/// each receiver NACKs its own losses, which are resent to it alone. Every
+/// receiver advertises the free space of its socket buffer along with the last
+/// packet it read, and the shared transmission waits for the receiver with the
+/// least space left once what was sent after that packet is taken off.
+namespace fanout {
+
+class session {
+public:
+    /// Stream bytes [start, start + size) read from src, sent on sock
+    session(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+            const rudp::options& opt, stats::transfer* st);
+
+    /// Add a receiver, sending it the data size first if announce is set.
+    /// Return false once the transmission is over
+    bool join(const sockaddr_in& addr, const bool announce);
+
+    /// Transmit till every receiver has all the data or went silent.
+    /// Return the number of receivers that got all of it, -1 if src or the
+    /// socket failed
+    int run();
+
+    /// Receivers dropped for going silent, once run() returned
+    inline int went_silent() const { return silent; }
+
+private:
+    struct subscriber {
+        sockaddr_in addr;
+        uint64_t covered;               // bytes of the shared transmission sent since it joined
+        RangeSet<uint64_t> repairs;     // NACKed and not resent yet
+        int64_t credit;                 // bytes it takes till its next window update
+        uint64_t sent;                  // bytes of data sent to it
+        std::deque<std::pair<uint32_t, uint64_t>> unread;  // seqno and sent before each packet not read yet
+        bool heard;                     // advertised a window yet
+        bool done;
+        timespec last_active;           // last feedback from or packet to it
+    };
+
+    session(const session&);
+    session& operator=(const session&);
+
+    void read_feedback(const int timeout_ms);
+    bool fill(packet* pckt, const uint64_t seqno, const int len);
+    void account(subscriber* s, const uint64_t seqno, const int len);
+
+    udp_util::udpsocket* sock;
+    const rudp::source src;
+    const uint64_t start;
+    const int64_t size;
+    const int payload_size;
+    const int pace_window;
+    stats::transfer* st;
+
+    std::mutex mtx;
+    std::vector<subscriber> subscribers;
+    bool over = false;
+    int silent = 0;
+};
+
+/// Server side of the file service in fanout mode: requests for a file that
+/// is being sent join that transmission, others start a new one on a new socket.
+/// A transmission is freed, socket, file and thread, as soon as it is over.
+class distributor {
+public:
+    distributor(const rudp::options& opt, const udp_util::netem_config& netem);
+    /// Waits for the running transmissions
+    ~distributor();
+
+    /// Serve a request for file_name that came from listener->toaddr
+    void request(udp_util::udpsocket* listener, const std::string& file_name);
+
+    /// Receivers that got a whole file or went silent, over the transmissions
+    /// that are over
+    inline int receivers_completed() const { return completed; }
+    inline int receivers_silent() const { return silent; }
+
+    /// Transmissions running or over and not freed yet
+    size_t transmissions();
+
+private:
+    struct transmission {
+        udp_util::udpsocket sock;
+        FILE* fd;
+        session* s;
+        stats::transfer st;
+        std::thread worker;
+        bool finished;                  // guarded by mtx
+    };
+
+    distributor(const distributor&);
+    distributor& operator=(const distributor&);
+
+    void run(transmission* t, const std::string file_name);
+    void reap_finished();
+    void reap(const bool all);
+
+    const rudp::options opt;
+    const udp_util::netem_config netem;
+    std::map<std::string, transmission*> running;
+    std::vector<transmission*> retired;
+    std::atomic<int> completed;
+    std::atomic<int> silent;
+
+    std::mutex mtx;                     // running, retired and their finished flags
+    std::condition_variable reaper_cv;  // a transmission is over, or stopping
+    bool stopping = false;
+    std::thread reaper;
+};
+
+} // namespace fanout
+
+#endif // FANOUT_H
@@ -2,7 +2,7 @@
 
 #include <string.h>
 
-FileBufferedWriter::FileBufferedWriter(const char* filename, const uint32_t size)
+FileBufferedWriter::FileBufferedWriter(const char* filename, const uint64_t size)
     :   buf_writing_window(0, size), file_writing_window(0, size),
         buf_size(size), threashold(0.75 * size) {
     buf = new char[buf_size];
@@ -11,12 +11,12 @@ FileBufferedWriter::FileBufferedWriter(const char* filename, const uint32_t size
     of.open(filename);
 }
 
-Range<uint32_t> FileBufferedWriter::write(const char* data, const Range<uint32_t>& r) {
+Range<uint64_t> FileBufferedWriter::write(const char* data, const Range<uint64_t>& r) {
     soft_reset();
     return write_in_buf(data, r);
 }
 
-uint32_t FileBufferedWriter::adjust() {
+uint64_t FileBufferedWriter::adjust() {
     while(buf_writing_window.len() > 0 && acked[buf_writing_window.start()]) {
         buf_writing_window = buf_writing_window.move_start_by(1);
         file_writing_window = file_writing_window.move_start_by(1);
@@ -25,7 +25,7 @@ uint32_t FileBufferedWriter::adjust() {
 }
 
 /// Return: total number of bytes written to file
-uint32_t FileBufferedWriter::close() {
+uint64_t FileBufferedWriter::close() {
     hard_reset();
     of.close();
     return tot_written;
@@ -36,11 +36,11 @@ FileBufferedWriter::~FileBufferedWriter() {
     delete buf;
 }
 
-Range<uint32_t> FileBufferedWriter::write_in_buf(const char* data, const Range<uint32_t>& r) {
-    Range<uint32_t> sect = file_writing_window.intersect(r);
+Range<uint64_t> FileBufferedWriter::write_in_buf(const char* data, const Range<uint64_t>& r) {
+    Range<uint64_t> sect = file_writing_window.intersect(r);
     if (sect.len() > 0) {
-        Range<uint32_t> data_window(sect.start() - r.start(), sect.len());
-        Range<uint32_t> buf_window(sect.start() - tot_written, sect.len());;
+        Range<uint64_t> data_window(sect.start() - r.start(), sect.len());
+        Range<uint64_t> buf_window(sect.start() - tot_written, sect.len());;
 
         memcpy(buf + buf_window.start(), data + data_window.start(), sect.len());
         memset(acked + buf_window.start(), 1, sect.len());
@@ -59,13 +59,13 @@ bool FileBufferedWriter::soft_reset() {
 void FileBufferedWriter::hard_reset() {
     of.write(buf + buf_writing_window.start(), buf_size - buf_writing_window.len());
     tot_written = file_writing_window.start();
-    for (uint32_t i = 0; i < buf_writing_window.len(); ++i) {
+    for (uint64_t i = 0; i < buf_writing_window.len(); ++i) {
         buf[i] = buf[buf_writing_window.start() + i];
     }
-    for (uint32_t i = 0; i < buf_writing_window.len(); ++i) {
+    for (uint64_t i = 0; i < buf_writing_window.len(); ++i) {
         acked[i] = acked[buf_writing_window.start() + i];
     }
     memset(acked + buf_writing_window.len(), 0, buf_size - buf_writing_window.len());
-    buf_writing_window = Range<uint32_t>(0, buf_size);
-    file_writing_window = Range<uint32_t>(tot_written, buf_size);
+    buf_writing_window = Range<uint64_t>(0, buf_size);
+    file_writing_window = Range<uint64_t>(tot_written, buf_size);
 }
@@ -0,0 +1,239 @@
+#include "netem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+
+#include "packet.h"
+#include "trace.h"
+
+namespace udp_util {
+
+namespace {
+
+/* Probability, "0.01" or "1%" */
+bool parse_prob(const std::string& v, double* p) {
+    char* end;
+    *p = strtod(v.c_str(), &end);
+    if (*end == '%') {
+        *p /= 100.0;
+        end++;
+    }
+    return *end == '\0' && *p >= 0.0 && *p <= 1.0;
+}
+
+/* Time in microseconds, "20ms", "500us", "1s" or bare milliseconds */
+bool parse_time(const std::string& v, long* us) {
+    char* end;
+    double t = strtod(v.c_str(), &end);
+    std::string unit(end);
+    if (unit == "" || unit == "ms") t *= 1000;
+    else if (unit == "s") t *= 1000000;
+    else if (unit != "us") return false;
+    *us = (long) t;
+    return t >= 0;
+}
+
+/* Rate in bit/s, "10mbit", "512kbit", "1gbit" or bare bit/s */
+bool parse_rate(const std::string& v, double* bps) {
+    char* end;
+    *bps = strtod(v.c_str(), &end);
+    std::string unit(end);
+    if (unit == "kbit") *bps *= 1e3;
+    else if (unit == "mbit") *bps *= 1e6;
+    else if (unit == "gbit") *bps *= 1e9;
+    else if (unit != "" && unit != "bit") return false;
+    return *bps >= 0;
+}
+
+/* Seqno of a data packet or ackno of an ACK, both in the same place of the header.
+   Only the low 32 bits travel, 0 for datagrams too short to have a header */
+uint64_t header_seqno(const void* buf, const int bufsize) {
+    packet hdr;
+    if (bufsize < PCKT_HEADER_SIZE) {
+        return 0;
+    }
+    memcpy(&hdr, buf, PCKT_HEADER_SIZE);
+    return hdr.seqno;
+}
+
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+} // namespace
+
+bool netem_config::enabled() const {
+    return delay_us > 0 || jitter_us > 0 || reorder > 0 || duplicate > 0 || ge_p > 0
+        || loss_good > 0 || rate_bps > 0;
+}
+
+bool parse_netem(const char* spec, netem_config* cfg) {
+    std::string s(spec);
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        std::string item = s.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string key = item.substr(0, eq), value = item.substr(eq + 1);
+        bool ok;
+        if (key == "delay") ok = parse_time(value, &cfg->delay_us);
+        else if (key == "jitter") ok = parse_time(value, &cfg->jitter_us);
+        else if (key == "loss") ok = parse_prob(value, &cfg->loss_good);
+        else if (key == "dup") ok = parse_prob(value, &cfg->duplicate);
+        else if (key == "reorder") ok = parse_prob(value, &cfg->reorder);
+        else if (key == "rate") ok = parse_rate(value, &cfg->rate_bps);
+        else if (key == "limit") ok = sscanf(value.c_str(), "%ld", &cfg->limit_bytes) == 1;
+        else if (key == "seed") ok = sscanf(value.c_str(), "%lu", &cfg->seed) == 1;
+        else if (key == "ge") {
+            /* p:r[:loss_bad[:loss_good]] */
+            double v[4] = {0.0, 1.0, 1.0, cfg->loss_good};
+            int n = sscanf(value.c_str(), "%lf:%lf:%lf:%lf", &v[0], &v[1], &v[2], &v[3]);
+            ok = n >= 2;
+            for (double p : v) {
+                ok = ok && p >= 0.0 && p <= 1.0;
+            }
+            cfg->ge_p = v[0];
+            cfg->ge_r = v[1];
+            cfg->loss_bad = v[2];
+            cfg->loss_good = v[3];
+        }
+        else ok = false;
+        if (!ok) return false;
+    }
+    return true;
+}
+
+bool netem_from_env(netem_config* cfg) {
+    const char* spec = getenv("RUDP_NETEM");
+    if (spec != NULL && !parse_netem(spec, cfg)) {
+        fprintf(stderr, "netem: ignoring malformed RUDP_NETEM=\"%s\"\n", spec);
+        *cfg = netem_config();
+        return false;
+    }
+    return spec != NULL;
+}
+
+void attach_netem(udpsocket* s, const netem_config& cfg, const uint64_t conn_id, const netem_side side) {
+    delete s->em;
+    s->em = cfg.enabled() ? new netem(cfg, conn_id, side) : nullptr;
+}
+
+void detach_netem(udpsocket* s) {
+    delete s->em;
+    s->em = nullptr;
+}
+
+netem::netem(const netem_config& config, const uint64_t conn_id, const netem_side side)
+    :   dropped(0), queue_drops(0), duplicated(0), reordered(0), cfg(config), uniform(0.0, 1.0),
+        link_free(clock::now()) {
+    uint64_t seed = cfg.seed ? cfg.seed : std::random_device{}();
+    gen.seed(splitmix64(seed ^ splitmix64(conn_id) ^ splitmix64(~(uint64_t) side)));
+}
+
+netem::~netem() {
+    mtx.lock();
+    stopping = true;
+    mtx.unlock();
+    cv.notify_one();
+    if (worker != nullptr) {
+        worker->join();
+        delete worker;
+    }
+}
+
+bool netem::lost() {
+    if (cfg.ge_p > 0) {
+        bad_state = bad_state ? uniform(gen) >= cfg.ge_r : uniform(gen) < cfg.ge_p;
+    }
+    double loss = bad_state ? cfg.loss_bad : cfg.loss_good;
+    return loss > 0 && uniform(gen) < loss;
+}
+
+int netem::send(const int fd, const void* buf, const int bufsize, const sockaddr_in& to, const socklen_t addr_len) {
+    std::lock_guard<std::mutex> guard(mtx);
+    if (lost()) {
+        dropped++;
+        trace::emit(trace::DROP, header_seqno(buf, bufsize), bufsize, 1);
+        return bufsize;
+    }
+    clock::time_point now = clock::now();
+    schedule(fd, buf, bufsize, to, addr_len, now);
+    if (cfg.duplicate > 0 && uniform(gen) < cfg.duplicate) {
+        duplicated++;
+        schedule(fd, buf, bufsize, to, addr_len, now);
+    }
+    return bufsize;
+}
+
+/// Called with mtx held
+void netem::schedule(const int fd, const void* buf, const int bufsize, const sockaddr_in& to,
+                     const socklen_t addr_len, const clock::time_point now) {
+    clock::time_point depart = now;
+    if (cfg.rate_bps > 0) {
+        /* Fluid bottleneck: the backlog is what the link has not serialized yet */
+        link_free = std::max(link_free, now);
+        double backlog = std::chrono::duration<double>(link_free - now).count() * cfg.rate_bps / 8;
+        if (cfg.limit_bytes > 0 && backlog + bufsize > cfg.limit_bytes) {
+            queue_drops++;
+            trace::emit(trace::DROP, header_seqno(buf, bufsize), bufsize, 2);
+            return;
+        }
+        link_free += std::chrono::duration_cast<clock::duration>(
+                         std::chrono::duration<double>(bufsize * 8 / cfg.rate_bps));
+        depart = link_free;
+    }
+
+    clock::time_point release = depart;
+    if (cfg.reorder > 0 && uniform(gen) < cfg.reorder) {
+        reordered++;
+    } else {
+        long jitter = cfg.jitter_us > 0 ? (long) ((uniform(gen) * 2 - 1) * cfg.jitter_us) : 0;
+        release += std::chrono::microseconds(std::max(0L, cfg.delay_us + jitter));
+    }
+
+    if (release <= now && pending.empty()) {
+        sendto(fd, buf, bufsize, 0, (const sockaddr*) &to, addr_len);
+        return;
+    }
+    datagram d;
+    d.release = release;
+    d.order = order++;
+    d.fd = fd;
+    d.to = to;
+    d.addr_len = addr_len;
+    d.data.assign((const char*) buf, (const char*) buf + bufsize);
+    pending.push(std::move(d));
+    if (worker == nullptr) {
+        worker = new std::thread(&netem::release_thread, this);
+    }
+    cv.notify_one();
+}
+
+void netem::release_thread() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping || !pending.empty()) {
+        if (pending.empty()) {
+            cv.wait(lock);
+            continue;
+        }
+        if (pending.top().release > clock::now()) {
+            cv.wait_until(lock, pending.top().release);
+            continue;
+        }
+        const datagram& d = pending.top();
+        sendto(d.fd, d.data.data(), d.data.size(), 0, (const sockaddr*) &d.to, d.addr_len);
+        pending.pop();
+    }
+}
+
+} // namespace udp_util
@@ -0,0 +1,115 @@
+#ifndef NETEM_H
+#define NETEM_H
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "udp-util.h"
+
+namespace udp_util {
+
+/// Impairments applied to the datagrams a socket sends. Run both endpoints
+/// with an emulator to impair both directions.
+struct netem_config {
+    long delay_us = 0;
+    long jitter_us = 0;         // uniform in [-jitter, +jitter]
+    double reorder = 0.0;       // probability a packet skips the delay
+    double duplicate = 0.0;
+    /* Gilbert-Elliott loss: P(good->bad), P(bad->good) and loss rate in each state.
+       A plain Bernoulli loss only uses loss_good. */
+    double ge_p = 0.0;
+    double ge_r = 1.0;
+    double loss_good = 0.0;
+    double loss_bad = 0.0;
+    double rate_bps = 0.0;      // bottleneck bandwidth, 0 for unlimited
+    long limit_bytes = 0;       // bottleneck queue, 0 for unlimited
+    uint64_t seed = 0;          // 0 seeds randomly
+
+    bool enabled() const;
+};
+
+/// Parse a comma separated spec like "delay=20ms,jitter=2ms,loss=1%,dup=0.1%,
+/// reorder=1%,ge=0.01:0.3:0.5:0,rate=10mbit,limit=64000,seed=7" into cfg.
+/// ge is p:r[:loss_bad[:loss_good]], the example loses half the packets in the
+/// bad state and none in the good one. Times default to ms and rates to bit/s.
+/// Return false on a malformed spec or a probability outside [0, 1].
+bool parse_netem(const char* spec, netem_config* cfg);
+
+/// Fill cfg from $RUDP_NETEM, return true if it was set
+bool netem_from_env(netem_config* cfg);
+
+/// End of the connection the emulator sits on, the two directions of one
+/// connection must not draw the same random numbers
+enum netem_side { SERVER_SIDE = 0, CLIENT_SIDE = 1 };
+
+/// Route the datagrams sent by s through an emulator, none if cfg is not enabled
+void attach_netem(udpsocket* s, const netem_config& cfg, const uint64_t conn_id, const netem_side side);
+
+/// Send whatever the emulator still delays, then remove it
+void detach_netem(udpsocket* s);
+
+class netem {
+public:
+    /// The generator is seeded from cfg.seed, conn_id and side so every
+    /// direction of every connection sees its own, reproducible, loss and delay pattern.
+    netem(const netem_config& cfg, const uint64_t conn_id, const netem_side side);
+    /// Blocks until every delayed datagram is sent
+    ~netem();
+
+    /// Impair and eventually send the datagram; returns bufsize like a real network would
+    int send(const int fd, const void* buf, const int bufsize, const sockaddr_in& to, const socklen_t addr_len);
+
+    std::atomic<uint64_t> dropped;        // random and Gilbert-Elliott losses
+    std::atomic<uint64_t> queue_drops;    // bottleneck queue overflow
+    std::atomic<uint64_t> duplicated;
+    std::atomic<uint64_t> reordered;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct datagram {
+        clock::time_point release;
+        uint64_t order;
+        int fd;
+        sockaddr_in to;
+        socklen_t addr_len;
+        std::vector<char> data;
+
+        bool operator>(const datagram& d) const {
+            return release > d.release || (release == d.release && order > d.order);
+        }
+    };
+
+    netem(const netem&);
+    netem& operator=(const netem&);
+
+    bool lost();
+    void schedule(const int fd, const void* buf, const int bufsize, const sockaddr_in& to,
+                  const socklen_t addr_len, const clock::time_point now);
+    void release_thread();
+
+    const netem_config cfg;
+    std::mt19937_64 gen;
+    std::uniform_real_distribution<double> uniform;
+    bool bad_state = false;
+    clock::time_point link_free;
+    uint64_t order = 0;
+
+    std::priority_queue<datagram, std::vector<datagram>, std::greater<datagram>> pending;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread* worker = nullptr;
+};
+
+} // namespace udp_util
+
+#endif // NETEM_H
@@ -0,0 +1,64 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cstdint>
+#include <string.h>
+
+#define PCKT_HEADER_SIZE 8
+/* Largest payload fitting an unfragmented datagram on a 1500 bytes MTU */
+#define MAX_PAYLOAD_SIZE (1472 - PCKT_HEADER_SIZE)
+#define DEFAULT_PAYLOAD_SIZE 200
+
+/* Data-only packets */
+struct packet {
+    /* Header */
+    uint16_t cksum;
+    uint16_t len;
+    uint32_t seqno; // low 32 bits of the 64-bit byte offset
+    /* Data */
+    char data[MAX_PAYLOAD_SIZE];
+};
+
+/* Ack-only packets are only 12 bytes. window is the free space the receiver has
+   past the bytes it holds in order, the sender keeps no more than that in flight.
+   In fanout mode they carry NACKs instead: [ackno, ackno + len) is missing. With
+   len 0, ackno is either the end, the receiver has everything, or the seqno of the
+   last packet it read, a window update. window is its free socket buffer space */
+struct ack_packet {
+    uint16_t cksum;
+    uint16_t len;
+    uint32_t ackno;
+    uint32_t window;
+};
+
+/* First ACK carrying the requested file size (-1 if not found). len is 0, which
+   no data packet has, and there is no padding left to send uninitialized */
+struct file_size_packet {
+    uint16_t cksum;
+    uint16_t len;
+    uint32_t reserved;  // 0
+    int64_t file_size;
+};
+
+static_assert(sizeof(file_size_packet) == 16, "file_size_packet must have no padding");
+
+/* ARQ scheme, server and client must use the same one */
+enum arq_mode { STOP_AND_WAIT, SELECTIVE_REPEAT, GO_BACK_N, FANOUT };
+
+/* Mode named "snw", "sr", "gbn" or "fanout" in server.in/client.in; when the name is empty the
+   window decides as it always did: < 1 for stop-and-wait, selective repeat otherwise */
+inline bool parse_mode(const char* name, const int window, arq_mode* mode) {
+    if (name == NULL || *name == '\0') *mode = window < 1 ? STOP_AND_WAIT : SELECTIVE_REPEAT;
+    else if (!strcmp(name, "snw")) *mode = STOP_AND_WAIT;
+    else if (!strcmp(name, "sr")) *mode = SELECTIVE_REPEAT;
+    else if (!strcmp(name, "gbn")) *mode = GO_BACK_N;
+    else if (!strcmp(name, "fanout")) *mode = FANOUT;
+    else return false;
+    return true;
+}
+
+inline const char* mode_name(const arq_mode mode) {
+    return mode == STOP_AND_WAIT ? "snw" : mode == SELECTIVE_REPEAT ? "sr" : mode == GO_BACK_N ? "gbn" : "fanout";
+}
+
+#endif // PACKET_H
@@ -0,0 +1,367 @@
+#include "receiver.h"
+
+#include <iostream>
+#include <string.h>
+
+#include "packet.h"
+#include "trace.h"
+#include "util.h"
+
+#define FILE_BUFFER_SIZE 100000
+#define BUFFER_SIZE 250
+#define MAX_RETRY 100
+
+using namespace std;
+
+namespace receiver {
+
+const unsigned long long TIME_OUT = 999999;
+
+int send_ack(udp_util::udpsocket* sock, const uint64_t ackno, const int len, const uint32_t window,
+             stats::transfer* st) {
+    ack_packet ack;
+    ack.cksum = 1;
+    ack.ackno = (uint32_t) ackno;
+    ack.len = len;
+    ack.window = window;
+    trace::emit(trace::ACK, ackno, len);
+    st->packets_sent++;
+    st->bytes_sent += sizeof ack;
+    return udp_util::send(sock, &ack, sizeof ack);
+}
+
+namespace stop_and_wait {
+
+int64_t receive(udp_util::udpsocket* sock, const rudp::sink& dst, const uint64_t start, const int64_t size,
+                stats::transfer* st) {
+    packet curr_pckt;
+    const uint64_t end = start + size;
+    uint64_t curr_pckt_no = start;
+
+    while(curr_pckt_no < end) {
+        // Block until receiving packet from the server
+        int recv_bytes = 0;
+        if ((recv_bytes = udp_util::recvtimed(sock, &curr_pckt, sizeof(curr_pckt), TIME_OUT)) < 0) {
+            perror("client: recvfrom failed");
+            break;
+        }
+
+        st->packets_received++;
+
+        uint64_t seqno = expand_seqno(curr_pckt_no, curr_pckt.seqno);
+        trace::emit(trace::RECV, seqno, curr_pckt.len, recv_bytes);
+
+        if (seqno == curr_pckt_no) {
+            if (!dst(curr_pckt.data, curr_pckt_no - start, recv_bytes-8)) {
+                break;
+            }
+            curr_pckt_no += recv_bytes-8;
+            st->bytes_delivered += recv_bytes-8;
+        } else {
+            st->packets_discarded++;
+            trace::emit(trace::DISCARD, seqno, curr_pckt.len);
+        }
+        if (seqno <= curr_pckt_no) {
+            /* Room for one packet, the sender never has more in flight */
+            send_ack(sock, seqno, recv_bytes-8, sizeof(curr_pckt.data), st);
+        }
+    }
+
+    return curr_pckt_no - start;
+}
+} // namespace stop_and_wait
+
+namespace selective_repeat {
+
+const unsigned long long TIME_OUT = 500000; // 0.5 sec
+
+/// Free space advertised to the sender: what is left of the window and of the
+/// buffer past the bytes held in order, 0 while the full buffer waits for dst
+inline uint32_t free_space(const int window_size, const int buf_base) {
+    return max(0, min(window_size, FILE_BUFFER_SIZE - buf_base));
+}
+
+int64_t receive(udp_util::udpsocket* sock, const rudp::sink& dst, const uint64_t start, const int64_t size,
+                const int window_size, stats::transfer* st) {
+    const int64_t end = start + size;
+    st->cwnd = window_size;
+
+    bool acked[FILE_BUFFER_SIZE];
+    char file_data[FILE_BUFFER_SIZE];
+
+    int buf_base = 0;
+    int64_t recvbase = start;
+    bool aborted = false;
+
+    memset(acked, 0, sizeof(acked));
+    while(recvbase + buf_base < end) {
+        /// TODO use circular queue
+        if (buf_base == FILE_BUFFER_SIZE) {
+            if (!dst(file_data, recvbase - start, FILE_BUFFER_SIZE)) {
+                aborted = true;
+                break;
+            }
+            memset(acked, 0, FILE_BUFFER_SIZE);
+            buf_base = 0;
+            recvbase += FILE_BUFFER_SIZE;
+            /* Window update, the sender stopped at the zero window of the full buffer */
+            send_ack(sock, recvbase, 0, free_space(window_size, buf_base), st);
+        }
+
+        packet curr_pckt;
+        if (udp_util::recvtimed(sock, &curr_pckt, sizeof(curr_pckt), TIME_OUT) < 0) {
+            perror("client: recvfrom failed");
+            break;
+        }
+
+        st->packets_received++;
+
+        int64_t window_start = recvbase + buf_base;
+        int64_t window_len = free_space(window_size, buf_base);
+
+        int64_t seqno = expand_seqno(window_start, curr_pckt.seqno);
+        int64_t pckt_start = max(seqno, window_start);
+        int64_t pckt_end = seqno + curr_pckt.len;
+        pckt_end = max(window_start, pckt_end);
+        pckt_end = min(window_start + window_len, pckt_end);
+        pckt_end = min(pckt_start + window_len, pckt_end);
+        int pckt_len = pckt_end - pckt_start;
+        trace::emit(trace::RECV, seqno, curr_pckt.len, window_len);
+
+        if (pckt_len > 0) {
+            int start_in_buf = pckt_start - recvbase;
+            int start_in_pckt = pckt_start - seqno;
+            memcpy(file_data + start_in_buf, curr_pckt.data + start_in_pckt, pckt_len);
+            memset(acked + start_in_buf, 1, pckt_len);
+
+            // advance window base to next unACKed seq#
+            int old_base = buf_base;
+            for (; buf_base < FILE_BUFFER_SIZE && acked[buf_base]; ++buf_base);
+            st->bytes_delivered += buf_base - old_base;
+
+            int64_t ack_start = min(seqno, pckt_start);
+            send_ack(sock, ack_start, pckt_end - ack_start, free_space(window_size, buf_base), st);
+        } else if (seqno + curr_pckt.len <= window_start) {
+            send_ack(sock, seqno, curr_pckt.len, window_len, st);
+        } else {
+            st->packets_discarded++;
+            trace::emit(trace::DISCARD, seqno, curr_pckt.len, window_len);
+            /* Nothing acked, but a sender probing a zero window learns the current one */
+            send_ack(sock, window_start, 0, window_len, st);
+        }
+    }
+
+    if (buf_base > 0 && !aborted) {
+        if (dst(file_data, recvbase - start, buf_base)) {
+            recvbase += buf_base;
+        }
+    }
+    return recvbase - start;
+}
+
+} // namespace selective_repeat
+
+namespace go_back_n {
+
+/// Free space advertised to the sender: what the socket's receive buffer takes
+/// now, in payload bytes, at most window_size. Copies a go-back left queued are
+/// not in flight for the sender any more but still use the buffer
+inline uint32_t free_space(const udp_util::udpsocket* sock, const int window_size, const int payload_size) {
+    uint32_t window = window_size > 0 ? window_size : UINT32_MAX;
+    int room = udp_util::receive_room(sock, PCKT_HEADER_SIZE + payload_size);
+    return room < 0 ? window : (uint32_t) min<uint64_t>(window, (uint64_t) room * payload_size);
+}
+
+/// Accept only the next expected byte, so nothing is buffered beyond the packet
+/// being received, and answer every packet with a cumulative ACK. The socket
+/// buffer is all there is to overflow, its free space is the advertised window.
+int64_t receive(udp_util::udpsocket* sock, const rudp::sink& dst, const uint64_t start, const int64_t size,
+                const int window_size, const int payload_size, stats::transfer* st) {
+    packet curr_pckt;
+    const uint64_t end = start + size;
+    uint64_t expected = start;
+
+    while (expected < end) {
+        int recv_bytes = 0;
+        if ((recv_bytes = udp_util::recvtimed(sock, &curr_pckt, sizeof(curr_pckt), TIME_OUT)) < 0) {
+            perror("client: recvfrom failed");
+            break;
+        }
+
+        st->packets_received++;
+
+        uint64_t seqno = expand_seqno(expected, curr_pckt.seqno);
+        trace::emit(trace::RECV, seqno, curr_pckt.len, recv_bytes);
+
+        if (seqno == expected && recv_bytes == PCKT_HEADER_SIZE + curr_pckt.len) {
+            if (!dst(curr_pckt.data, expected - start, curr_pckt.len)) {
+                break;
+            }
+            expected += curr_pckt.len;
+            st->bytes_delivered += curr_pckt.len;
+        } else {
+            st->packets_discarded++;
+            trace::emit(trace::DISCARD, seqno, curr_pckt.len);
+        }
+        send_ack(sock, expected, 0, free_space(sock, window_size, payload_size), st);
+    }
+
+    return expected - start;
+}
+
+} // namespace go_back_n
+
+namespace fanout {
+
+const long NACK_INTERVAL = 20000;   // 20 ms without data: NACK what is missing
+const int MAX_NACKS = 64;           // NACK packets per interval
+const int NACK_RETRY = 250;         // silent intervals before the server is considered gone
+const int DONE_COPIES = 3;          // the final ACK is never answered, send it a few times
+
+/// Advertise the free space left after last_read, the seqno of the last packet
+/// read. Return the space advertised
+uint32_t send_window(udp_util::udpsocket* sock, const uint32_t last_read, const int payload_size,
+                     stats::transfer* st) {
+    uint32_t window = go_back_n::free_space(sock, 0, payload_size);
+    send_ack(sock, last_read, 0, window, st);
+    return window;
+}
+
+/// Store every packet where it belongs, whatever order the shared transmission
+/// and the repairs come in. NACKs go out only when the data stops flowing, so a
+/// receiver that joined late waits for the transmission to wrap around first.
+/// Every ACK advertises the free space of the socket buffer, see
+/// go_back_n::free_space(). A window update, an empty ACK for the last packet
+/// read, goes out whenever half of the last advertised space has been read and
+/// whenever the socket has been drained.
+int64_t receive(udp_util::udpsocket* sock, const rudp::sink& dst, const uint64_t start, const int64_t size,
+                const int payload_size, stats::transfer* st) {
+    packet curr_pckt;
+    const uint64_t end = start + size;
+    RangeSet<uint64_t> have;
+    uint64_t received = 0, last = start;
+    int silences = 0;
+    uint32_t last_read = (uint32_t) start, read_since_update = 0;
+    uint32_t window = send_window(sock, last_read, payload_size, st);
+
+    while ((int64_t) received < size) {
+        int recv_bytes = udp_util::recv_nowait(sock, &curr_pckt, sizeof(curr_pckt));
+        if (recv_bytes < 0) {
+            /* All read, the sender may be waiting for the space that freed */
+            if (read_since_update > 0) {
+                window = send_window(sock, last_read, payload_size, st);
+                read_since_update = 0;
+            }
+            recv_bytes = udp_util::recvtimed(sock, &curr_pckt, sizeof(curr_pckt), NACK_INTERVAL);
+        }
+        if (recv_bytes >= PCKT_HEADER_SIZE) {
+            if (recv_bytes != PCKT_HEADER_SIZE + curr_pckt.len) {
+                continue; // a repeated file size ACK
+            }
+            st->packets_received++;
+            last_read = curr_pckt.seqno;
+            read_since_update += curr_pckt.len;
+            if (read_since_update >= window / 2) {
+                window = send_window(sock, last_read, payload_size, st);
+                read_since_update = 0;
+            }
+            silences = 0;
+            uint64_t seqno = expand_seqno_within(start, end, last, curr_pckt.seqno);
+            uint64_t pckt_end = min(seqno + curr_pckt.len, end);
+            trace::emit(trace::RECV, seqno, curr_pckt.len, recv_bytes);
+
+            if (seqno >= start && seqno < pckt_end && !have.contains(seqno, pckt_end)) {
+                if (!dst(curr_pckt.data, seqno - start, pckt_end - seqno)) {
+                    break;
+                }
+                uint64_t added = have.insert(seqno, pckt_end);
+                received += added;
+                st->bytes_delivered += added;
+                last = seqno;
+            } else {
+                st->packets_discarded++;
+                trace::emit(trace::DISCARD, seqno, curr_pckt.len);
+            }
+            continue;
+        }
+
+        trace::emit(trace::TIMEOUT, start + received, 0);
+        if (++silences >= NACK_RETRY) {
+            cerr << "client: no data after " << NACK_RETRY << " NACK rounds" << endl;
+            break;
+        }
+        int nacks = 0;
+        window = go_back_n::free_space(sock, 0, payload_size);
+        read_since_update = 0;
+        for (const Range<uint64_t>& gap : have.gaps(start, end)) {
+            for (uint64_t pos = gap.start(); pos < gap.end() && nacks < MAX_NACKS; ++nacks) {
+                int len = min<uint64_t>(gap.end() - pos, UINT16_MAX);
+                send_ack(sock, pos, len, window, st);
+                pos += len;
+            }
+        }
+    }
+
+    if ((int64_t) received == size) {
+        for (int i = 0; i < DONE_COPIES; ++i) {
+            send_ack(sock, end, 0, window, st);
+        }
+    }
+    return received;
+}
+
+} // namespace fanout
+
+/// Keep sending filename to the server till it receives an ACK
+/// Returns filesize received from the server, -1 if it never answered or the
+/// request could not be sent
+int64_t request_file(udp_util::udpsocket* sock, const char* filename) {
+    int64_t filesize = -1;
+    const sockaddr_in server = sock->toaddr;
+
+    for(int i = 0; i < MAX_RETRY; ++i) {
+        if (udp_util::send(sock, filename, strlen(filename)) == -1) {
+            perror("client: error sending pckt!");
+            return -1;
+        }
+
+        char buf[BUFFER_SIZE];
+        file_size_packet ack;
+        int received = udp_util::recvtimed(sock, buf, BUFFER_SIZE, TIME_OUT);
+        if (received < 0) {
+            perror("client: timeout to receive filesize: ");
+            continue;
+        }
+        /* A data packet may be as long, but never has len 0 */
+        memcpy(&ack, buf, min<int>(received, sizeof(ack)));
+        if (received != sizeof(ack) || ack.cksum != 1 || ack.len != 0) {
+            cerr << "Didn't receive right ACK - received " << received << " bytes instead" << endl;
+            /* Ask the server again, not whoever sent that */
+            sock->toaddr = server;
+            sock->addr_len = sizeof(server);
+            continue;
+        }
+        filesize = ack.file_size;
+        cout << "client: received ACK from server - filesize=" << filesize << endl;
+        break;
+    }
+
+    return filesize;
+}
+
+int64_t receive(udp_util::udpsocket* sock, const rudp::sink& dst, const uint64_t start, const int64_t size,
+                const rudp::options& opt, stats::transfer* st) {
+    if (opt.mode == STOP_AND_WAIT) {
+        return stop_and_wait::receive(sock, dst, start, size, st);
+    }
+    if (opt.mode == GO_BACK_N) {
+        return go_back_n::receive(sock, dst, start, size, opt.window,
+                                  max(1, min(opt.payload_size, MAX_PAYLOAD_SIZE)), st);
+    }
+    if (opt.mode == FANOUT) {
+        return fanout::receive(sock, dst, start, size, max(1, min(opt.payload_size, MAX_PAYLOAD_SIZE)), st);
+    }
+    return selective_repeat::receive(sock, dst, start, size, opt.window, st);
+}
+
+} // namespace receiver
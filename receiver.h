@@ -0,0 +1,25 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+
+#include <cstdint>
+
+#include "connection.h"
+#include "stats.h"
+#include "udp-util.h"
+
+namespace receiver {
+
+/// Keep sending filename to the server till it receives an ACK
+/// Returns filesize received from the server, -1 if it never answered
+int64_t request_file(udp_util::udpsocket* sock, const char* filename);
+
+/// Receive stream bytes [start, start + size) into dst with opt.mode, up to
+/// opt.window bytes are buffered out of order for selective repeat only. The
+/// free buffer space goes back in every ACK as the sender's receive window.
+/// Returns number of bytes received
+int64_t receive(udp_util::udpsocket* sock, const rudp::sink& dst, const uint64_t start, const int64_t size,
+                const rudp::options& opt, stats::transfer* st);
+
+} // namespace receiver
+
+#endif // RECEIVER_H
@@ -0,0 +1,521 @@
+#include "sender.h"
+
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "fanout.h"
+#include "packet.h"
+#include "trace.h"
+#include "util.h"
+
+#define FILE_BUFFER_SIZE 100000
+#define MAX_RETRY 50 // consecutive ACK timeouts before the client is considered gone
+
+using namespace std;
+
+namespace sender {
+
+/// Bytes allowed in flight: the congestion window capped by the receive window
+/// the client advertised. A zero window still lets one packet out, resent on
+/// the timer like any other, so the sender learns when the window opens again.
+inline int send_limit(const int cwnd, const uint32_t rwnd, const int payload_size) {
+    return rwnd == 0 ? payload_size : (int) min<uint64_t>(cwnd, rwnd);
+}
+
+long usec_since(const timespec& t) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t.tv_sec) * 1000000 + (now.tv_nsec - t.tv_nsec) / 1000;
+}
+
+namespace stop_and_wait {
+
+const long TIME_OUT = 100000; // 0.1 sec
+
+bool recv_ack(const uint64_t seqno, udp_util::udpsocket* sock, stats::transfer* st,
+              const long time_out = TIME_OUT) {
+    ack_packet ack;
+    int recv_bytes = 0;
+    if ((recv_bytes = udp_util::recvtimed(sock, &ack, sizeof(ack), time_out)) != sizeof(ack)) {
+        trace::emit(trace::TIMEOUT, seqno, 0);
+        return false;
+    }
+    st->packets_received++;
+    trace::emit(trace::ACK, expand_seqno(seqno, ack.ackno), ack.len);
+    if (ack.ackno != (uint32_t) seqno) {
+        st->spurious_retransmits++;
+        return false;
+    }
+    return true;
+}
+
+int send_packet_till_ack(udp_util::udpsocket* sock, const packet* pckt, const uint64_t seqno,
+                         stats::transfer* st) {
+    int sent;
+    int pckt_size = PCKT_HEADER_SIZE + pckt->len;
+    trace::event_type type = trace::SEND;
+    timespec first_sent;
+    clock_gettime(CLOCK_MONOTONIC, &first_sent);
+    int attempts = 0;
+
+    do {
+        st->packets_sent++;
+        st->bytes_sent += pckt_size;
+        if (attempts++ > 0) {
+            st->packets_retransmitted++;
+        }
+        if (attempts > MAX_RETRY) {
+            cerr << "server: no ACK for " << seqno << " after " << MAX_RETRY << " attempts" << endl;
+            return -1;
+        }
+        if ((sent = udp_util::send(sock, pckt, pckt_size)) == -1) {
+            perror("server: error sending pckt!");
+            return -1;
+        }
+        else if (sent == 0) continue;
+        trace::emit(type, seqno, pckt->len);
+        type = trace::RETRANSMIT;
+    } while(!recv_ack(seqno, sock, st));
+
+    /* Karn: only packets acked on their first transmission give an RTT sample */
+    if (attempts == 1) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        st->rtt_us.add((now.tv_sec - first_sent.tv_sec) * 1000000 + (now.tv_nsec - first_sent.tv_nsec) / 1000);
+    }
+    st->bytes_delivered += sent - PCKT_HEADER_SIZE;
+    return sent - PCKT_HEADER_SIZE;
+}
+
+int64_t send(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+             const int payload_size, stats::transfer* st) {
+    packet curr_pckt;
+    st->cwnd = payload_size;
+
+    int64_t tot_bytes = 0;
+    for (int sent = 0; tot_bytes < size; tot_bytes += sent) {
+        curr_pckt.cksum = 1;
+        int len = src(curr_pckt.data, tot_bytes, min<int64_t>(payload_size, size - tot_bytes));
+        if (len <= 0) {
+            cerr << "server: cannot read data at " << tot_bytes << endl;
+            return -1;
+        }
+        curr_pckt.len = len;
+        curr_pckt.seqno = (uint32_t) (start + tot_bytes);
+        if ((sent = send_packet_till_ack(sock, &curr_pckt, start + tot_bytes, st)) < 0) {
+            return sent;
+        }
+    }
+
+    return size;
+}
+
+} // namespace stop_and_wait
+
+namespace selective_repeat {
+const unsigned long long TIME_OUT = 100000;
+
+/// Shared by the sending loop and the ACK listener of one transfer
+struct state {
+    udp_util::udpsocket* sock;
+    stats::transfer* st;
+    int payload_size;
+    int maximum_window;
+
+    mutex ack_lock;
+    bool acked[FILE_BUFFER_SIZE];
+    bool retransmitted[FILE_BUFFER_SIZE];
+    timespec time_sent[FILE_BUFFER_SIZE];
+    char file_data[FILE_BUFFER_SIZE];
+
+    atomic<uint64_t> first_byte_seqno;
+    atomic<uint32_t> rwnd;      // receive window of the last ACK
+    atomic<bool> finished;
+    atomic<bool> aborted;
+};
+
+
+class window {
+public:
+    window(const int payload_size, const int maximum_window, stats::transfer* st)
+        :   payload_size(payload_size), maximum_window(maximum_window), st(st) { reset_window(); }
+
+    void reset_window() {
+        mtx.lock();
+        w = payload_size;
+        st->cwnd = w;
+        mtx.unlock();
+    }
+
+    inline int window_size() { return w; }
+
+    void decrease_window() {
+        mtx.lock();
+        w /= 2;
+        w = max(w, payload_size);
+        st->cwnd = w;
+        trace::emit(trace::WINDOW, 0, 0, w);
+        mtx.unlock();
+    }
+
+    void increase_window() {
+        mtx.lock();
+        w += payload_size;
+        w = min(w, maximum_window);
+        st->cwnd = w;
+        mtx.unlock();
+    }
+
+    inline void lock() { mtx.lock(); }
+    inline void unlock() { mtx.unlock(); }
+
+private:
+    const int payload_size;
+    const int maximum_window;
+    stats::transfer* st;
+    int w;
+    mutex mtx;
+};
+
+/// Return false if the socket failed
+bool send_packet(state* s, uint64_t seqno, int len) {
+    packet pckt;
+    pckt.seqno = (uint32_t) seqno;
+    pckt.len = len;
+    pckt.cksum = 1;
+
+    int pbase = seqno - s->first_byte_seqno;
+    memcpy(pckt.data, s->file_data + pbase, len);
+
+    int pckt_size = PCKT_HEADER_SIZE + pckt.len;
+    /* Stamped before it leaves, the ACK listener may see its ACK before send returns */
+    timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    s->ack_lock.lock();
+    bool retransmit = s->time_sent[pbase].tv_sec != 0;
+    for (int i = 0; i < len; ++i) {
+        s->time_sent[pbase + i] = time_now;
+        s->retransmitted[pbase + i] = retransmit;
+    }
+    s->ack_lock.unlock();
+
+    stats::transfer* st = s->st;
+    st->packets_sent++;
+    st->bytes_sent += pckt_size;
+    if (retransmit) {
+        st->packets_retransmitted++;
+    }
+    if (udp_util::send(s->sock, &pckt, pckt_size) == -1) {
+        perror("server: error sending pckt!");
+        return false;
+    }
+    trace::emit(retransmit ? trace::RETRANSMIT : trace::SEND, seqno, pckt.len);
+    return true;
+}
+
+/// Update transfer stats for an ACK of [start, end), called with ack_lock held
+void record_ack(state* s, const int64_t start, const int64_t end) {
+    stats::transfer* st = s->st;
+    if (s->acked[start]) {
+        if (s->retransmitted[start]) {
+            st->spurious_retransmits++;
+        }
+    } else if (!s->retransmitted[start] && s->time_sent[start].tv_sec != 0) {
+        /* Karn: retransmitted bytes give no RTT sample */
+        st->rtt_us.add(usec_since(s->time_sent[start]));
+    }
+    for (int64_t i = start; i < end; ++i) {
+        st->bytes_delivered += !s->acked[i];
+    }
+}
+
+void ack_listener_thread(state* s, window *w, const long time_out) {
+    int timeouts = 0;
+    while(!s->finished && !s->aborted) {
+        ack_packet ack;
+        if (udp_util::recvtimed(s->sock, &ack, sizeof(ack), time_out) == sizeof(ack)) {
+            s->st->packets_received++;
+            timeouts = 0;
+            s->ack_lock.lock();
+            uint64_t ackno = expand_seqno(s->first_byte_seqno, ack.ackno);
+            int64_t ack_start = (int64_t) (ackno - s->first_byte_seqno);
+            int64_t ack_end = min<int64_t>(max<int64_t>(0, ack_start + ack.len), FILE_BUFFER_SIZE);
+            ack_start = max<int64_t>(0, ack_start);
+            if (ack_end > ack_start) {
+                record_ack(s, ack_start, ack_end);
+                memset(s->acked + ack_start, 1, ack_end - ack_start);
+            }
+            s->ack_lock.unlock();
+            s->rwnd = ack.window;
+            s->st->rwnd = ack.window;
+
+            if (ack_end - ack_start > 0) {
+                w->increase_window();
+            }
+            trace::emit(trace::ACK, ackno, ack.len, w->window_size());
+        } else {
+            trace::emit(trace::TIMEOUT, s->first_byte_seqno, 0);
+            /* No ACK to a zero window probe says nothing about congestion */
+            if (s->rwnd > 0) {
+                w->decrease_window();
+            }
+            if (++timeouts >= MAX_RETRY) {
+                cerr << "server: no ACK after " << MAX_RETRY << " timeouts" << endl;
+                s->aborted = true;
+            }
+        }
+    }
+}
+
+int64_t send(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+             const int payload_size, const int maximum_window, stats::transfer* st) {
+    /* Too big for the stack of a thread */
+    unique_ptr<state> s(new state());
+    s->sock = sock;
+    s->st = st;
+    s->payload_size = payload_size;
+    s->maximum_window = maximum_window;
+    s->first_byte_seqno = start;
+    s->rwnd = maximum_window;   // till the client advertises one
+    st->rwnd = maximum_window;
+    s->finished = false;
+    s->aborted = false;
+
+    int64_t read_data = 0;
+    window w(payload_size, maximum_window, st);
+
+    /* Launch a listener thread for ACKs */
+    thread ack_listener(ack_listener_thread, s.get(), &w, TIME_OUT);
+
+    int base = 0;
+    int buf_size = 0;
+
+    while(!s->finished && !s->aborted) {
+        /// TODO use circular queue
+        // advance window base to next unACKed seq#
+        s->ack_lock.lock();
+        for (; base < buf_size && s->acked[base]; ++base);
+        if (base == buf_size) {
+            s->first_byte_seqno += buf_size;
+            buf_size = 0;
+            if (read_data < size) {
+                buf_size = src(s->file_data, read_data, min<int64_t>(FILE_BUFFER_SIZE, size - read_data));
+            }
+            if (buf_size <= 0 && read_data < size) {
+                cerr << "server: cannot read data at " << read_data << endl;
+                s->aborted = true;
+                buf_size = 0;
+            }
+            memset(s->acked, 0, buf_size);
+            memset(s->retransmitted, 0, buf_size);
+            memset(s->time_sent, 0, sizeof s->time_sent);
+            base = 0;
+            read_data += buf_size;
+        }
+        s->ack_lock.unlock();
+
+        timespec time_now;
+        clock_gettime(CLOCK_MONOTONIC, &time_now);
+        unsigned long long time_now_micro = time_now.tv_sec * 1000000ULL + time_now.tv_nsec / 1000;
+
+        vector<pair<int, int>> pckts_to_be_sent;
+        int l = base, r = base;
+
+        w.lock();
+        const int limit = send_limit(w.window_size(), s->rwnd, payload_size);
+        for (; r - base < limit && r < buf_size; r++) {
+            s->ack_lock.lock();
+            unsigned long long time_sent_micro = s->time_sent[r].tv_sec * 1000000ULL + s->time_sent[r].tv_nsec / 1000;
+            unsigned long long time_passed = time_now_micro - time_sent_micro;
+            if (s->acked[r] || time_passed < TIME_OUT || r - l == payload_size) {
+                if (l < r) {
+                    pckts_to_be_sent.push_back({l, r});
+                }
+                l = (r - l == payload_size) ? r : r + 1;
+            }
+            s->ack_lock.unlock();
+        }
+        if (l < r) {
+            pckts_to_be_sent.push_back({l, r});
+        }
+        w.unlock();
+
+        for (auto& p : pckts_to_be_sent) {
+            if (!send_packet(s.get(), p.first + s->first_byte_seqno, p.second - p.first)) {
+                s->aborted = true;
+                break;
+            }
+        }
+        s->finished = (base == buf_size);
+    }
+    ack_listener.join();
+    return s->aborted ? -1 : size;
+}
+
+} // namespace selective_repeat
+
+namespace go_back_n {
+
+const long TIME_OUT = 100000; // 0.1 sec, runs on the oldest unacked packet
+const int DUP_ACKS = 3;       // duplicate ACKs that resend the window before the timeout
+
+struct in_flight {
+    uint64_t end;       // seqno past the last byte of the packet
+    timespec time_sent;
+    bool retransmit;
+};
+
+/// Single threaded: keep up to max_window bytes in flight, and no more than the
+/// client advertises, slide on cumulative ACKs and resend everything from the
+/// oldest unacked byte on timeout or after DUP_ACKS duplicate ACKs. After a
+/// go-back the copies sent before it are still arriving and their duplicate
+/// ACKs, all for the base it went back to, say nothing about the new ones:
+/// going back again on duplicate ACKs takes an ACK that moves the base first.
+int64_t send(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+             const int payload_size, const int max_window, stats::transfer* st) {
+    const uint64_t end = start + size;
+    uint64_t base = start, next = start, highest = start;
+    bool base_moved = true;     // since the last go-back
+    int w = payload_size;
+    st->cwnd = w;
+    uint32_t rwnd = max_window; // till the client advertises one
+    st->rwnd = rwnd;
+    deque<in_flight> flight;
+    int timeouts = 0;
+    int dup_acks = 0;
+
+    packet pckt;
+    pckt.cksum = 1;
+    while (base < end) {
+        for (; next < end && next - base < (uint64_t) send_limit(w, rwnd, payload_size); next += pckt.len) {
+            int len = min<int64_t>(payload_size, end - next);
+            if (src(pckt.data, next - start, len) != len) {
+                cerr << "server: cannot read data at " << next - start << endl;
+                return -1;
+            }
+            pckt.len = len;
+            pckt.seqno = (uint32_t) next;
+            int pckt_size = PCKT_HEADER_SIZE + pckt.len;
+            bool retransmit = next < highest;
+            st->packets_sent++;
+            st->bytes_sent += pckt_size;
+            if (retransmit) {
+                st->packets_retransmitted++;
+            }
+            if (udp_util::send(sock, &pckt, pckt_size) == -1) {
+                perror("server: error sending pckt!");
+                return -1;
+            }
+            trace::emit(retransmit ? trace::RETRANSMIT : trace::SEND, next, pckt.len);
+
+            in_flight f;
+            f.end = next + pckt.len;
+            clock_gettime(CLOCK_MONOTONIC, &f.time_sent);
+            f.retransmit = retransmit;
+            flight.push_back(f);
+            highest = max(highest, f.end);
+        }
+
+        ack_packet ack;
+        long remaining = TIME_OUT - usec_since(flight.front().time_sent);
+        int recv_bytes = remaining > 0 ? udp_util::recvtimed(sock, &ack, sizeof(ack), remaining) : -1;
+        if (recv_bytes == sizeof(ack)) {
+            st->packets_received++;
+            /* ackno is the next byte the client expects, anything below is delivered */
+            uint64_t ackno = expand_seqno(base, ack.ackno);
+            trace::emit(trace::ACK, ackno, ack.len, w);
+            rwnd = ack.window;
+            st->rwnd = rwnd;
+            if (ackno == base && next > base && ++dup_acks >= DUP_ACKS && base_moved) {
+                w = max(w / 2, payload_size);
+                st->cwnd = w;
+                trace::emit(trace::WINDOW, 0, 0, w);
+                base_moved = false;
+                next = base;
+                flight.clear();
+                dup_acks = 0;
+            }
+            if (ackno <= base || ackno > highest) {
+                continue;
+            }
+            timeouts = 0;
+            dup_acks = 0;
+            st->bytes_delivered += ackno - base;
+            base = ackno;
+            base_moved = true;
+            if (next < base) {
+                /* Acked by a copy sent before the last timeout */
+                next = base;
+                flight.clear();
+            }
+            in_flight acked = {0, {0, 0}, true};
+            for (; !flight.empty() && flight.front().end <= base; flight.pop_front()) {
+                acked = flight.front();
+            }
+            /* Karn: retransmitted packets give no RTT sample */
+            if (!acked.retransmit) {
+                st->rtt_us.add(usec_since(acked.time_sent));
+            }
+            w = min(w + payload_size, max(max_window, payload_size));
+            st->cwnd = w;
+        } else if (recv_bytes < 0 && usec_since(flight.front().time_sent) >= TIME_OUT) {
+            trace::emit(trace::TIMEOUT, base, 0);
+            if (++timeouts >= MAX_RETRY) {
+                cerr << "server: no ACK after " << MAX_RETRY << " timeouts" << endl;
+                return -1;
+            }
+            if (rwnd > 0) {
+                w = max(w / 2, payload_size);
+                st->cwnd = w;
+                trace::emit(trace::WINDOW, 0, 0, w);
+            }
+            base_moved = false;
+            next = base;
+            flight.clear();
+            dup_acks = 0;
+        }
+    }
+    return size;
+}
+
+} // namespace go_back_n
+
+bool send_first_ack(udp_util::udpsocket* sock, const int64_t filesize) {
+    file_size_packet ack;
+    ack.cksum = 1;
+    ack.len = 0;
+    ack.reserved = 0;
+    ack.file_size = filesize;
+    /* Past the emulator: the server never resends it, a lost one would leave the client reading data as the reply */
+    if (sendto(sock->fd, &ack, sizeof(ack), 0, (sockaddr*) &sock->toaddr, sock->addr_len) == -1) {
+        perror("server: error sending first ACK pckt!");
+        return false;
+    }
+    return true;
+}
+
+int64_t send(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+             const rudp::options& opt, stats::transfer* st) {
+    int payload_size = max(1, min(opt.payload_size, MAX_PAYLOAD_SIZE));
+    if (opt.mode == STOP_AND_WAIT) {
+        return stop_and_wait::send(sock, src, start, size, payload_size, st);
+    }
+    if (opt.mode == GO_BACK_N) {
+        return go_back_n::send(sock, src, start, size, payload_size, opt.window, st);
+    }
+    if (opt.mode == FANOUT) {
+        /* A single receiver: the peer of the socket */
+        fanout::session s(sock, src, start, size, opt, st);
+        s.join(sock->toaddr, false);
+        return s.run() > 0 ? size : -1;
+    }
+    return selective_repeat::send(sock, src, start, size, payload_size, opt.window, st);
+}
+
+} // namespace sender
@@ -0,0 +1,25 @@
+#ifndef SENDER_H
+#define SENDER_H
+
+#include <cstdint>
+
+#include "connection.h"
+#include "stats.h"
+#include "udp-util.h"
+
+namespace sender {
+
+/// Send stream bytes [start, start + size) read from src with opt.mode, at most
+/// opt.window bytes in flight for selective repeat and go-back-N, and no more
+/// than the receive window the client advertises.
+/// Return size or -1 if error happened, errno set if the socket failed
+int64_t send(udp_util::udpsocket* sock, const rudp::source& src, const uint64_t start, const int64_t size,
+             const rudp::options& opt, stats::transfer* st);
+
+/// Answer a file request with the file size, -1 if not found.
+/// Return false if it could not be sent
+bool send_first_ack(udp_util::udpsocket* sock, const int64_t filesize);
+
+} // namespace sender
+
+#endif // SENDER_H
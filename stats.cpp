@@ -0,0 +1,239 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "netem.h"
+
+namespace stats {
+
+namespace {
+
+const long DEFAULT_INTERVAL_MS = 1000;
+
+std::mutex exporter_lock;
+std::condition_variable exporter_cv;
+std::thread* exporter = nullptr;
+bool stopping = false;
+
+const char* g_role = "";
+const udp_util::udpsocket* g_sock = nullptr;
+transfer* g_transfer = nullptr;
+FILE* out = NULL;
+int unix_fd = -1;
+sockaddr_un unix_addr;
+
+bool open_output() {
+    const char* path = getenv("RUDP_STATS");
+    char default_path[64];
+    if (path == NULL) {
+        snprintf(default_path, sizeof(default_path), "stats.%d.log", (int) getpid());
+        path = default_path;
+    }
+    if (!strncmp(path, "unix:", 5)) {
+        if ((unix_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+            perror("stats: cannot create unix socket");
+            return false;
+        }
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, path + 5, sizeof(unix_addr.sun_path) - 1);
+        return true;
+    }
+    if ((out = fopen(path, "a")) == NULL) {
+        perror("stats: cannot open stats file");
+        return false;
+    }
+    return true;
+}
+
+void close_output() {
+    if (out != NULL) {
+        fclose(out);
+        out = NULL;
+    }
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unix_fd = -1;
+    }
+}
+
+void export_line(transfer& t) {
+    poll_drops(&t, g_sock);
+    double secs = elapsed_sec(t);
+    uint64_t sent = t.packets_sent;
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+        "t=%.3f role=%s pid=%d goodput_Bps=%.0f delivered_B=%lu sent_B=%lu sent_pkts=%lu "
+        "retx_pkts=%lu retx_ratio=%.4f spurious=%lu dropped=%lu recv_pkts=%lu discarded=%lu "
+        "socket_drops=%lu cwnd=%u rwnd=%u rtt_p50_us=%lu rtt_p90_us=%lu rtt_p99_us=%lu\n",
+        secs, g_role, (int) getpid(), secs > 0 ? t.bytes_delivered / secs : 0.0,
+        (unsigned long) t.bytes_delivered, (unsigned long) t.bytes_sent, (unsigned long) sent,
+        (unsigned long) t.packets_retransmitted, sent ? (double) t.packets_retransmitted / sent : 0.0,
+        (unsigned long) t.spurious_retransmits, (unsigned long) t.packets_dropped,
+        (unsigned long) t.packets_received, (unsigned long) t.packets_discarded,
+        (unsigned long) t.socket_drops, (unsigned) t.cwnd, (unsigned) t.rwnd,
+        (unsigned long) t.rtt_us.percentile(50),
+        (unsigned long) t.rtt_us.percentile(90), (unsigned long) t.rtt_us.percentile(99));
+    if (out != NULL) {
+        fwrite(line, 1, len, out);
+        fflush(out);
+    } else if (unix_fd >= 0) {
+        /* Nobody listening is not an error */
+        sendto(unix_fd, line, len, MSG_DONTWAIT, (sockaddr*) &unix_addr, sizeof(unix_addr));
+    }
+}
+
+void exporter_thread(const long interval_ms) {
+    std::unique_lock<std::mutex> lock(exporter_lock);
+    while (!stopping) {
+        exporter_cv.wait_for(lock, std::chrono::milliseconds(interval_ms));
+        export_line(*g_transfer);
+    }
+}
+
+} // namespace
+
+void histogram::reset() {
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets[i] = 0;
+    }
+    n = 0;
+    lo = UINT64_MAX;
+    hi = 0;
+}
+
+int histogram::bucket_of(const uint64_t v) {
+    if (v < SUB_BUCKETS) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return (e - 2) * SUB_BUCKETS + ((v >> (e - 3)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t histogram::bucket_start(const int b) {
+    if (b < SUB_BUCKETS) {
+        return b;
+    }
+    int e = b / SUB_BUCKETS + 2;
+    return (uint64_t) (SUB_BUCKETS + b % SUB_BUCKETS) << (e - 3);
+}
+
+void histogram::add(const uint64_t v) {
+    buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+    n.fetch_add(1, std::memory_order_relaxed);
+    uint64_t cur = lo;
+    while (v < cur && !lo.compare_exchange_weak(cur, v));
+    cur = hi;
+    while (v > cur && !hi.compare_exchange_weak(cur, v));
+}
+
+uint64_t histogram::percentile(const double p) const {
+    uint64_t total = n;
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t) (p / 100.0 * total + 0.5));
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            uint64_t next = b + 1 < BUCKETS ? bucket_start(b + 1) : max();
+            uint64_t mid = bucket_start(b) + (next - bucket_start(b)) / 2;
+            return std::min<uint64_t>(std::max<uint64_t>(mid, min()), max());
+        }
+    }
+    return max();
+}
+
+double elapsed_sec(const transfer& t) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t.start_time.tv_sec) + (now.tv_nsec - t.start_time.tv_nsec) / 1e9;
+}
+
+void reset(transfer* t, const udp_util::udpsocket* sock) {
+    t->bytes_sent = t->packets_sent = t->packets_retransmitted = t->spurious_retransmits = 0;
+    t->packets_dropped = t->packets_received = t->packets_discarded = t->bytes_delivered = 0;
+    t->socket_drops = 0;
+    t->cwnd = t->rwnd = 0;
+    t->rtt_us.reset();
+    long drops = udp_util::socket_drops(sock);
+    t->socket_drops_base = drops > 0 ? drops : 0;
+    clock_gettime(CLOCK_MONOTONIC, &t->start_time);
+}
+
+void begin(const char* role, const udp_util::udpsocket* sock, transfer* t) {
+    reset(t, sock);
+    /* The exporter may be running for the previous transfer */
+    exporter_lock.lock();
+    g_role = role;
+    g_sock = sock;
+    g_transfer = t;
+    exporter_lock.unlock();
+    if (exporter == nullptr && open_output()) {
+        const char* interval = getenv("RUDP_STATS_INTERVAL");
+        long interval_ms = interval != NULL ? atol(interval) : DEFAULT_INTERVAL_MS;
+        stopping = false;
+        exporter = new std::thread(exporter_thread, interval_ms > 0 ? interval_ms : DEFAULT_INTERVAL_MS);
+    }
+}
+
+void end(std::ostream& os) {
+    if (exporter != nullptr) {
+        exporter_lock.lock();
+        stopping = true;
+        exporter_lock.unlock();
+        exporter_cv.notify_one();
+        exporter->join();
+        delete exporter;
+        exporter = nullptr;
+        close_output();
+    } else {
+        poll_drops(g_transfer, g_sock);
+    }
+    summarize(*g_transfer, os);
+}
+
+void poll_drops(transfer* t, const udp_util::udpsocket* sock) {
+    long drops = udp_util::socket_drops(sock);
+    if (drops >= 0) {
+        t->socket_drops = drops - t->socket_drops_base;
+    }
+    if (sock->em != nullptr) {
+        t->packets_dropped = sock->em->dropped + sock->em->queue_drops;
+    }
+}
+
+void summarize(const transfer& t, std::ostream& os, const char* role) {
+    double secs = elapsed_sec(t);
+    uint64_t sent = t.packets_sent;
+    char buf[768];
+    int len = snprintf(buf, sizeof(buf),
+        "Transfer summary (%s): %lu bytes in %.3f s, goodput %.1f KB/s\n"
+        "  packets sent %lu (%lu bytes), retransmitted %lu (%.2f%%), spurious %lu, dropped %lu\n"
+        "  packets received %lu, discarded %lu, socket drops %lu\n",
+        role != nullptr ? role : *g_role ? g_role : "transfer", (unsigned long) t.bytes_delivered, secs, secs > 0 ? t.bytes_delivered / secs / 1000 : 0.0,
+        (unsigned long) sent, (unsigned long) t.bytes_sent, (unsigned long) t.packets_retransmitted,
+        sent ? 100.0 * t.packets_retransmitted / sent : 0.0, (unsigned long) t.spurious_retransmits,
+        (unsigned long) t.packets_dropped, (unsigned long) t.packets_received,
+        (unsigned long) t.packets_discarded, (unsigned long) t.socket_drops);
+    if (t.rtt_us.count() > 0) {
+        len += snprintf(buf + len, sizeof(buf) - len,
+            "  RTT us: samples %lu, min %lu, p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+            (unsigned long) t.rtt_us.count(), (unsigned long) t.rtt_us.min(),
+            (unsigned long) t.rtt_us.percentile(50), (unsigned long) t.rtt_us.percentile(90),
+            (unsigned long) t.rtt_us.percentile(99), (unsigned long) t.rtt_us.max());
+    }
+    os << buf;
+}
+
+} // namespace stats
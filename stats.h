@@ -0,0 +1,81 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <time.h>
+
+#include "udp-util.h"
+
+/// Per-transfer counters exported periodically while a transfer runs.
+///
+/// Every RUDP_STATS_INTERVAL ms (default 1000) one key=value line is appended
+/// to "stats.<pid>.log", or to $RUDP_STATS; a value of "unix:<path>" sends
+/// each line as a datagram to that Unix socket instead.
+namespace stats {
+
+/// Lock-free log-linear histogram: 8 buckets per power of two, so any
+/// percentile is within 12.5% of the real value.
+class histogram {
+public:
+    histogram() { reset(); }
+
+    void reset();
+    void add(const uint64_t v);
+    uint64_t percentile(const double p) const;
+    inline uint64_t count() const { return n; }
+    inline uint64_t min() const { return n ? lo.load() : 0; }
+    inline uint64_t max() const { return hi; }
+
+private:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    static int bucket_of(const uint64_t v);
+    static uint64_t bucket_start(const int b);
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> n, lo, hi;
+};
+
+struct transfer {
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> packets_sent;
+    std::atomic<uint64_t> packets_retransmitted;
+    std::atomic<uint64_t> spurious_retransmits;
+    std::atomic<uint64_t> packets_dropped;  // by the network emulator
+    std::atomic<uint64_t> packets_received;
+    std::atomic<uint64_t> packets_discarded;
+    std::atomic<uint64_t> bytes_delivered;  // acked by the client / written to file
+    std::atomic<uint64_t> socket_drops;     // dropped by the kernel, receive buffer full
+    std::atomic<uint32_t> cwnd;
+    std::atomic<uint32_t> rwnd;             // receive window the client advertised last
+    histogram rtt_us;
+
+    timespec start_time;
+    uint64_t socket_drops_base;
+};
+
+/// Zero the counters of t and restart its clock, kernel drops are counted from now on
+void reset(transfer* t, const udp_util::udpsocket* sock);
+
+/// Start exporting t, `sock` is polled for kernel and emulated drops. Only one
+/// transfer is exported at a time.
+void begin(const char* role, const udp_util::udpsocket* sock, transfer* t);
+
+/// Stop exporting and print a summary of the exported transfer.
+void end(std::ostream& os);
+
+double elapsed_sec(const transfer& t);
+
+/// Update the kernel and emulator drop counters of t from sock. The exporter
+/// does it for the exported transfer, others need it before summarize()
+void poll_drops(transfer* t, const udp_util::udpsocket* sock);
+
+/// Print the counters of t, labelled role or else the role of the exported transfer
+void summarize(const transfer& t, std::ostream& os, const char* role = nullptr);
+
+} // namespace stats
+
+#endif // STATS_H
@@ -0,0 +1,369 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
+#include <iostream>
+#include <random>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "connection.h"
+#include "fanout.h"
+#include "netem.h"
+#include "packet.h"
+#include "receiver.h"
+#include "sender.h"
+#include "udp-util.h"
+#include "util.h"
+
+/// Unit tests: sequence number expansion, RangeSet and transfers between two
+/// connections over loopback, with and without emulated loss.
+/// Prints every failed check and exits with the number of failures.
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << endl; \
+            failures++; \
+        } \
+    } while (0)
+
+const uint64_t SPAN = 1ULL << 32;
+
+void test_expand_seqno() {
+    CHECK(expand_seqno(0, 0) == 0);
+    CHECK(expand_seqno(1000, 1500) == 1500);
+    CHECK(expand_seqno(1000, 500) == 500);
+    /* There is nothing below offset 0 to wrap back to */
+    CHECK(expand_seqno(10, (uint32_t) -5) == SPAN - 5);
+    /* Crossing 2^32 forward and backward */
+    CHECK(expand_seqno(SPAN - 100, 50) == SPAN + 50);
+    CHECK(expand_seqno(SPAN + 50, (uint32_t) (SPAN - 100)) == SPAN - 100);
+    CHECK(expand_seqno(5 * SPAN + 7, 7) == 5 * SPAN + 7);
+    CHECK(expand_seqno(5 * SPAN + 7, (uint32_t) -1) == 5 * SPAN - 1);
+    /* Half the sequence space away either way */
+    CHECK(expand_seqno(SPAN, (uint32_t) (SPAN / 2 - 1)) == SPAN + SPAN / 2 - 1);
+    CHECK(expand_seqno(SPAN, (uint32_t) (SPAN / 2 + 1)) == SPAN / 2 + 1);
+}
+
+void test_expand_seqno_within() {
+    /* Closest to near already inside the window */
+    CHECK(expand_seqno_within(SPAN - 1000, SPAN + 1000, SPAN - 1000, 500) == SPAN + 500);
+    CHECK(expand_seqno_within(SPAN - 1000, SPAN + 1000, SPAN + 900, (uint32_t) (SPAN - 10)) == SPAN - 10);
+    /* A window wider than half the sequence space moves the candidate into it */
+    uint64_t start = SPAN - 100, end = start + SPAN / 2 + 200;
+    CHECK(expand_seqno_within(start, end, start, (uint32_t) (SPAN / 2 + 50)) == SPAN + SPAN / 2 + 50);
+    CHECK(expand_seqno_within(start, end, end, (uint32_t) (SPAN - 50)) == SPAN - 50);
+    /* Outside the window either way, left where expand_seqno put it */
+    CHECK(expand_seqno_within(SPAN, SPAN + 100, SPAN, 200) == SPAN + 200);
+    CHECK(expand_seqno_within(SPAN, SPAN + 100, SPAN, (uint32_t) -1) == SPAN - 1);
+}
+
+void test_range_set() {
+    RangeSet<uint64_t> set;
+    CHECK(set.empty());
+    CHECK(set.insert(10, 10) == 0);
+    CHECK(set.empty());
+    CHECK(set.insert(10, 20) == 10);
+    CHECK(set.insert(30, 40) == 10);
+    CHECK(set.insert(15, 35) == 10);
+    CHECK(set.first().start() == 10 && set.first().end() == 40);
+    CHECK(set.contains(10, 40));
+    CHECK(!set.contains(5, 15));
+    /* Touching ranges merge */
+    CHECK(set.insert(40, 50) == 10);
+    CHECK(set.insert(0, 10) == 10);
+    CHECK(set.contains(0, 50));
+    CHECK(set.insert(0, 50) == 0);
+
+    set.erase(20, 30);
+    CHECK(set.contains(0, 20) && set.contains(30, 50));
+    CHECK(!set.contains(19, 21));
+    vector<Range<uint64_t>> gaps = set.gaps(0, 60);
+    CHECK(gaps.size() == 2);
+    CHECK(gaps.size() == 2 && gaps[0].start() == 20 && gaps[0].end() == 30);
+    CHECK(gaps.size() == 2 && gaps[1].start() == 50 && gaps[1].end() == 60);
+    CHECK(set.gaps(0, 20).empty());
+    CHECK(set.gaps(25, 27).size() == 1);
+
+    set.erase(0, 5);
+    CHECK(set.first().start() == 5);
+    set.erase(0, 100);
+    CHECK(set.empty());
+
+    /* Ranges across 2^32 */
+    CHECK(set.insert(SPAN - 10, SPAN + 10) == 20);
+    CHECK(set.insert(SPAN, SPAN + 20) == 10);
+    CHECK(set.contains(SPAN - 10, SPAN + 20));
+}
+
+int local_port(int fd) {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr*) &addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/// Two connections over loopback sending to each other. Only what a sends is
+/// lost: nothing answers the final ACK, a sender missing it gives up.
+struct peers {
+    rudp::connection a, b;
+
+    peers(const rudp::options& opt, double plp) :
+        a(udp_util::create_socket(0, 0, INADDR_LOOPBACK), opt),
+        b(udp_util::create_socket(0, local_port(a.socket()->fd), INADDR_LOOPBACK), opt) {
+        a.socket()->toaddr.sin_port = htons(local_port(b.socket()->fd));
+        if (plp > 0) {
+            udp_util::netem_config cfg;
+            cfg.loss_good = plp;
+            cfg.seed = 7;
+            udp_util::attach_netem(a.socket(), cfg, 1, udp_util::SERVER_SIDE);
+        }
+    }
+};
+
+vector<char> random_bytes(size_t size, unsigned seed) {
+    mt19937 gen(seed);
+    vector<char> v(size);
+    for (char& c : v) {
+        c = (char) gen();
+    }
+    return v;
+}
+
+/// Several transfers in a row over the same pair of connections
+void test_transfers(arq_mode mode, double plp) {
+    rudp::options opt;
+    opt.mode = mode;
+    opt.window = 20000;
+    peers p(opt, plp);
+
+    vector<vector<char>> msgs = { random_bytes(37, 1), random_bytes(60000, 2), random_bytes(1, 3) };
+    thread t([&] {
+        for (const vector<char>& v : msgs) {
+            p.a.send(v.data(), v.size());
+        }
+    });
+    for (const vector<char>& v : msgs) {
+        vector<char> got(v.size());
+        CHECK(p.b.receive(got.data(), got.size()) == (int64_t) v.size());
+        CHECK(got == v);
+    }
+    t.join();
+    CHECK(p.b.counters().bytes_delivered == 60038);
+}
+
+/// A transfer whose stream offsets cross 2^32
+void test_wraparound(arq_mode mode, double plp) {
+    rudp::options opt;
+    opt.mode = mode;
+    opt.window = 20000;
+    peers p(opt, plp);
+
+    const uint64_t start = SPAN - 10000;
+    vector<char> data = random_bytes(40000, 4), got(data.size());
+    const char* from = data.data();
+    char* to = got.data();
+    stats::transfer sst, rst;
+    stats::reset(&sst, p.a.socket());
+    stats::reset(&rst, p.b.socket());
+
+    int64_t sent = 0;
+    thread t([&] {
+        sent = sender::send(p.a.socket(), [from](char* buf, uint64_t offset, int len) {
+            memcpy(buf, from + offset, len);
+            return len;
+        }, start, data.size(), opt, &sst);
+    });
+    int64_t received = receiver::receive(p.b.socket(), [to](const char* buf, uint64_t offset, int len) {
+        memcpy(to + offset, buf, len);
+        return true;
+    }, start, got.size(), opt, &rst);
+    t.join();
+    CHECK(sent == (int64_t) data.size());
+    CHECK(received == (int64_t) data.size());
+    CHECK(got == data);
+}
+
+/// Go-back-N resends at most a window per lost packet, the duplicate ACKs and
+/// timers of the copies still queued behind a loss must not start it again
+void test_go_back_n_retransmits(double plp) {
+    rudp::options opt;
+    opt.mode = GO_BACK_N;
+    opt.window = 100000;
+    peers p(opt, plp);
+
+    vector<char> data = random_bytes(1000000, 5), got(data.size());
+    thread t([&] {
+        p.a.send(data.data(), data.size());
+    });
+    CHECK(p.b.receive(got.data(), got.size()) == (int64_t) data.size());
+    t.join();
+    CHECK(got == data);
+
+    uint64_t losses = udp_util::socket_drops(p.a.socket()) + udp_util::socket_drops(p.b.socket());
+    if (p.a.socket()->em != nullptr) {
+        losses += p.a.socket()->em->dropped;
+    }
+    uint64_t window_packets = opt.window / DEFAULT_PAYLOAD_SIZE;
+    CHECK(p.a.counters().packets_retransmitted <= losses * window_packets);
+}
+
+/// A full window queued in the receive buffer fits without kernel drops
+void test_no_socket_drops(arq_mode mode) {
+    rudp::options opt;
+    opt.mode = mode;
+    opt.window = 100000;
+    peers p(opt, 0);
+
+    vector<char> data = random_bytes(1000000, 6), got(data.size());
+    thread t([&] {
+        p.a.send(data.data(), data.size());
+    });
+    CHECK(p.b.receive(got.data(), got.size()) == (int64_t) data.size());
+    t.join();
+    CHECK(got == data);
+    CHECK(udp_util::socket_drops(p.b.socket()) == 0);
+    CHECK(p.a.counters().packets_retransmitted == 0);
+}
+
+/// A fanout session keeps to the space a slow receiver advertises
+void test_fanout_slow_receiver() {
+    rudp::options opt;
+    opt.mode = FANOUT;
+    opt.window = 100000;
+    peers p(opt, 0);
+
+    vector<char> data = random_bytes(300000, 7), got(data.size());
+    char* to = got.data();
+    thread t([&] {
+        p.a.send(data.data(), data.size());
+    });
+    CHECK(p.b.receive([to](const char* buf, uint64_t offset, int len) {
+        memcpy(to + offset, buf, len);
+        usleep(50);
+        return true;
+    }, got.size()) == (int64_t) data.size());
+    t.join();
+    CHECK(got == data);
+    CHECK(udp_util::socket_drops(p.b.socket()) == 0);
+}
+
+/// Receivers of a file served by a fanout distributor over a lossy link: one
+/// joins late, one never answers after its request and is dropped
+void test_fanout_distributor() {
+    vector<char> data = random_bytes(300000, 8);
+    char path[] = "/tmp/rudp-fanout-XXXXXX";
+    int file_fd = mkstemp(path);
+    CHECK(file_fd >= 0 && write(file_fd, data.data(), data.size()) == (ssize_t) data.size());
+    close(file_fd);
+
+    rudp::options opt;
+    opt.mode = FANOUT;
+    opt.window = 20000;         // a sweep takes 150 ms, the second receiver joins halfway
+    udp_util::netem_config cfg;
+    cfg.loss_good = 0.05;
+    cfg.seed = 9;
+    fanout::distributor d(opt, cfg);
+    udp_util::udpsocket listener = udp_util::create_socket(0);
+    const int port = local_port(listener.fd);
+
+    atomic<bool> stop(false);
+    thread server([&] {
+        char name[100];
+        while (!stop) {
+            if (udp_util::recvtimed(&listener, name, sizeof(name), 10000) > 0) {
+                d.request(&listener, path);
+            }
+        }
+    });
+
+    udp_util::udpsocket silent = udp_util::create_socket(0, port, INADDR_LOOPBACK);
+    vector<vector<char>> got(2);
+    vector<thread> receivers;
+    for (size_t i = 0; i < got.size(); ++i) {
+        receivers.push_back(thread([&, i] {
+            rudp::connection conn(udp_util::create_socket(0, port, INADDR_LOOPBACK), opt);
+            int64_t size = rudp::request_file(&conn, "file");
+            CHECK(size == (int64_t) data.size());
+            got[i].resize(max<int64_t>(size, 0));
+            CHECK(conn.receive(got[i].data(), got[i].size()) == size);
+        }));
+        if (i == 0) {
+            usleep(20000);
+            udp_util::send(&silent, "file", 4);
+        }
+        usleep(50000);
+    }
+    for (thread& t : receivers) {
+        t.join();
+    }
+    for (const vector<char>& v : got) {
+        CHECK(v == data);
+    }
+
+    /* The transmission lasts till the silent one is dropped */
+    for (int i = 0; i < 1000 && d.receivers_completed() + d.receivers_silent() < 3; ++i) {
+        usleep(10000);
+    }
+    CHECK(d.receivers_completed() == 2);
+    CHECK(d.receivers_silent() == 1);
+    /* Freed without another request coming */
+    for (int i = 0; i < 100 && d.transmissions() > 0; ++i) {
+        usleep(10000);
+    }
+    CHECK(d.transmissions() == 0);
+    stop = true;
+    server.join();
+    close(listener.fd);
+    close(silent.fd);
+    unlink(path);
+}
+
+/// Socket errors come back as a failed transfer, the process goes on
+void test_socket_errors() {
+    udp_util::udpsocket taken = udp_util::create_socket(0);
+    udp_util::udpsocket sock = udp_util::create_socket(local_port(taken.fd), local_port(taken.fd), INADDR_LOOPBACK);
+    CHECK(sock.fd == -1 && errno == EADDRINUSE);
+    for (arq_mode mode : { STOP_AND_WAIT, SELECTIVE_REPEAT, GO_BACK_N, FANOUT }) {
+        rudp::options opt;
+        opt.mode = mode;
+        rudp::connection conn(sock, opt);
+        char buf[1000] = {};
+        CHECK(conn.send(buf, sizeof(buf)) == -1);
+    }
+    close(taken.fd);
+}
+
+int main() {
+    test_expand_seqno();
+    test_expand_seqno_within();
+    test_range_set();
+    for (arq_mode mode : { STOP_AND_WAIT, SELECTIVE_REPEAT, GO_BACK_N }) {
+        for (double plp : { 0.0, 0.05 }) {
+            cout << mode_name(mode) << " plp " << plp << endl;
+            test_transfers(mode, plp);
+            test_wraparound(mode, plp);
+        }
+    }
+    for (double plp : { 0.0, 0.01 }) {
+        cout << "gbn retransmits plp " << plp << endl;
+        test_go_back_n_retransmits(plp);
+    }
+    for (arq_mode mode : { SELECTIVE_REPEAT, GO_BACK_N }) {
+        cout << mode_name(mode) << " socket drops" << endl;
+        test_no_socket_drops(mode);
+    }
+    cout << "socket errors" << endl;
+    test_socket_errors();
+    cout << "fanout slow receiver" << endl;
+    test_fanout_slow_receiver();
+    cout << "fanout distributor" << endl;
+    test_fanout_distributor();
+    cout << (failures ? "FAILED: " : "OK: ") << failures << " failures" << endl;
+    return failures;
+}
@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "trace.h"
+
+using namespace std;
+
+/// Convert a binary trace written by the server or client to text or to a
+/// qlog-like JSON document.
+/// Usage: trace-dump <trace.bin> [text|qlog]
+
+const char* qlog_name(const trace::event_type type) {
+    switch (type) {
+    case trace::SEND:
+    case trace::RETRANSMIT:
+        return "transport:packet_sent";
+    case trace::RECV:
+        return "transport:packet_received";
+    case trace::ACK:
+        return "recovery:ack_received";
+    case trace::DROP:
+    case trace::DISCARD:
+        return "transport:packet_dropped";
+    case trace::TIMEOUT:
+        return "recovery:loss_timer_updated";
+    case trace::WINDOW:
+        return "recovery:metrics_updated";
+    default:
+        return "unknown";
+    }
+}
+
+void print_text(const vector<trace::event>& events) {
+    uint64_t t0 = events.empty() ? 0 : events[0].time_ns;
+    for (const trace::event& e : events) {
+        printf("%12.3f us  t%-2u %-10s %lu+%u value=%u\n", (e.time_ns - t0) / 1000.0, e.thread,
+               trace::type_name((trace::event_type) e.type), (unsigned long) e.seqno, e.len, e.value);
+    }
+}
+
+void print_qlog(const vector<trace::event>& events, const char* title) {
+    uint64_t t0 = events.empty() ? 0 : events[0].time_ns;
+    printf("{\"qlog_version\":\"0.3\",\"title\":\"%s\",\"traces\":[{\"common_fields\":"
+           "{\"time_format\":\"relative\",\"reference_time\":%.3f},\"events\":[\n", title, t0 / 1e6);
+    for (size_t i = 0; i < events.size(); ++i) {
+        const trace::event& e = events[i];
+        trace::event_type type = (trace::event_type) e.type;
+        printf("{\"time\":%.3f,\"name\":\"%s\",\"data\":{\"trigger\":\"%s\",\"thread\":%u,"
+               "\"offset\":%lu,\"length\":%u,\"value\":%u}}%s\n",
+               (e.time_ns - t0) / 1e6, qlog_name(type), trace::type_name(type), e.thread,
+               (unsigned long) e.seqno, e.len, e.value, i + 1 < events.size() ? "," : "");
+    }
+    printf("]}]}\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <trace.bin> [text|qlog]" << endl;
+        return -1;
+    }
+    FILE* fd = fopen(argv[1], "rb");
+    if (fd == NULL) {
+        perror("trace-dump: cannot open trace");
+        return -1;
+    }
+    char magic[sizeof(trace::TRACE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), fd) != sizeof(magic)
+        || memcmp(magic, trace::TRACE_MAGIC, sizeof(magic))) {
+        cerr << argv[1] << " is not a trace file" << endl;
+        fclose(fd);
+        return -1;
+    }
+
+    vector<trace::event> events;
+    trace::event e;
+    while (fread(&e, sizeof(e), 1, fd) == 1) {
+        events.push_back(e);
+    }
+    fclose(fd);
+
+    /* Rings are drained one thread at a time, restore the global order */
+    stable_sort(events.begin(), events.end(), [](const trace::event& a, const trace::event& b) {
+        return a.time_ns < b.time_ns;
+    });
+
+    if (argc > 2 && !strcmp(argv[2], "qlog")) {
+        print_qlog(events, argv[1]);
+    } else {
+        print_text(events);
+    }
+    return 0;
+}
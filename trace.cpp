@@ -0,0 +1,226 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace trace {
+
+std::atomic<int> g_level(OFF);
+
+namespace {
+
+const uint64_t RING_SIZE = 1 << 14; // events per thread, must be a power of 2
+const long DUMP_INTERVAL_MS = 50;
+
+/* Single-producer single-consumer ring: the owning thread moves head, the
+   dumper moves tail. Rings are recycled when their thread exits. */
+struct ring {
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> lost{0};
+    std::atomic<bool> in_use{false};
+    uint16_t id = 0;
+    event events[RING_SIZE];
+};
+
+struct ring_owner {
+    ring* r = nullptr;
+    ~ring_owner() {
+        if (r) {
+            r->in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ring_owner owner;
+
+std::mutex rings_lock;
+std::vector<ring*> rings;
+
+std::mutex dumper_lock;
+std::condition_variable dumper_cv;
+std::thread* dumper = nullptr;
+pid_t dumper_pid = 0;
+bool stopping = false;
+
+FILE* out = NULL;
+char out_path[256];
+bool level_from_env = false;
+
+const char* TYPE_NAMES[EVENT_TYPES] = {
+    "send", "retransmit", "recv", "ack", "drop", "discard", "timeout", "window"
+};
+
+void cycle_level(int) {
+    g_level = (g_level + 1) % (DEBUG + 1);
+}
+
+ring* acquire_ring() {
+    std::lock_guard<std::mutex> guard(rings_lock);
+    for (ring* r : rings) {
+        bool expected = false;
+        if (r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return r;
+        }
+    }
+    ring* r = new ring;
+    r->id = rings.size();
+    r->in_use = true;
+    rings.push_back(r);
+    return r;
+}
+
+bool open_output() {
+    if (out == NULL) {
+        if ((out = fopen(out_path, "wb")) == NULL) {
+            perror("trace: cannot open trace file");
+            return false;
+        }
+        fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), out);
+    }
+    return true;
+}
+
+void drain() {
+    std::vector<ring*> snapshot;
+    rings_lock.lock();
+    snapshot = rings;
+    rings_lock.unlock();
+
+    for (ring* r : snapshot) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        if (head != tail && open_output()) {
+            while (tail < head) {
+                uint64_t idx = tail & (RING_SIZE - 1);
+                uint64_t n = std::min(head - tail, RING_SIZE - idx);
+                fwrite(r->events + idx, sizeof(event), n, out);
+                tail += n;
+            }
+        }
+        r->tail.store(head, std::memory_order_release);
+    }
+    if (out != NULL) {
+        fflush(out);
+    }
+}
+
+void dumper_thread() {
+    std::unique_lock<std::mutex> lock(dumper_lock);
+    while (!stopping) {
+        dumper_cv.wait_for(lock, std::chrono::milliseconds(DUMP_INTERVAL_MS));
+        drain();
+    }
+}
+
+int parse_level(const char* s) {
+    if (s == NULL || !strcmp(s, "off")) return OFF;
+    if (!strcmp(s, "info")) return INFO;
+    if (!strcmp(s, "debug")) return DEBUG;
+    return std::max(0, std::min(atoi(s), (int) DEBUG));
+}
+
+} // namespace
+
+const char* type_name(const event_type type) {
+    return type < EVENT_TYPES ? TYPE_NAMES[type] : "unknown";
+}
+
+void set_level(const int l) {
+    g_level = l;
+}
+
+void handle_signals() {
+    /* Once, a forked child keeps the level its parent was switched to */
+    const char* level = getenv("RUDP_TRACE");
+    if (level != NULL && !level_from_env) {
+        set_level(parse_level(level));
+    }
+    level_from_env = true;
+    signal(SIGUSR1, cycle_level);
+}
+
+void start() {
+    if (dumper != nullptr && dumper_pid == getpid()) {
+        return;
+    }
+    /* A forked child inherits the parent's state but not its dumper thread,
+       forget both and skip events the parent has not dumped yet */
+    dumper = nullptr;
+    out = NULL;
+    for (ring* r : rings) {
+        r->tail = r->head.load();
+    }
+
+    const char* path = getenv("RUDP_TRACE_FILE");
+    if (path != NULL) {
+        snprintf(out_path, sizeof(out_path), "%s", path);
+    } else {
+        snprintf(out_path, sizeof(out_path), "trace.%d.bin", (int) getpid());
+    }
+    handle_signals();
+
+    stopping = false;
+    dumper_pid = getpid();
+    dumper = new std::thread(dumper_thread);
+}
+
+void stop() {
+    if (dumper == nullptr || dumper_pid != getpid()) {
+        return;
+    }
+    dumper_lock.lock();
+    stopping = true;
+    dumper_lock.unlock();
+    dumper_cv.notify_one();
+    dumper->join();
+    delete dumper;
+    dumper = nullptr;
+
+    uint64_t lost = 0;
+    for (ring* r : rings) {
+        lost += r->lost.exchange(0);
+    }
+    if (lost > 0) {
+        fprintf(stderr, "trace: %lu events lost, ring buffers were full\n", (unsigned long) lost);
+    }
+    if (out != NULL) {
+        fclose(out);
+        out = NULL;
+    }
+}
+
+void record(const event_type type, const uint64_t seqno, const uint32_t len, const uint32_t value) {
+    ring* r = owner.r;
+    if (r == nullptr) {
+        r = owner.r = acquire_ring();
+    }
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= RING_SIZE) {
+        r->lost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event& e = r->events[head & (RING_SIZE - 1)];
+    e.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e.seqno = seqno;
+    e.len = len;
+    e.value = value;
+    e.thread = r->id;
+    e.type = type;
+    memset(e.reserved, 0, sizeof(e.reserved));
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+} // namespace trace
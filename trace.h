@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+
+/// Binary event tracing for the transfer hot path.
+///
+/// Every thread records fixed-size events into its own lock-free ring; a
+/// background thread drains the rings to "trace.<pid>.bin" (or $RUDP_TRACE_FILE).
+/// The initial level comes from $RUDP_TRACE (off, info, debug) and SIGUSR1
+/// cycles it at runtime. Use bin/trace-dump to convert a trace to text or qlog.
+namespace trace {
+
+enum level {
+    OFF = 0,
+    INFO = 1,   // drops, retransmits, timeouts and window changes
+    DEBUG = 2   // every packet sent, received and acked
+};
+
+enum event_type : uint8_t {
+    SEND = 0,
+    RETRANSMIT,
+    RECV,
+    ACK,
+    DROP,
+    DISCARD,
+    TIMEOUT,
+    WINDOW,
+    EVENT_TYPES
+};
+
+struct event {
+    uint64_t time_ns;
+    uint64_t seqno;
+    uint32_t len;
+    uint32_t value;
+    uint16_t thread;
+    uint8_t type;
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(event) == 32, "trace events must stay 32 bytes");
+
+const char TRACE_MAGIC[8] = {'R', 'U', 'D', 'P', 'T', 'R', 'C', '1'};
+
+extern std::atomic<int> g_level;
+
+inline int level_of(const event_type type) {
+    return (type == SEND || type == RECV || type == ACK) ? DEBUG : INFO;
+}
+
+const char* type_name(const event_type type);
+
+void set_level(const int l);
+
+/// Take the level from $RUDP_TRACE and cycle it on SIGUSR1. Enough for a
+/// process that only forks the ones tracing, start() does it too.
+void handle_signals();
+
+/// Start the dumper thread, must be called again in a forked child.
+void start();
+
+/// Drain all rings and stop the dumper thread.
+void stop();
+
+void record(const event_type type, const uint64_t seqno, const uint32_t len, const uint32_t value);
+
+inline void emit(const event_type type, const uint64_t seqno, const uint32_t len, const uint32_t value = 0) {
+    if (level_of(type) <= g_level.load(std::memory_order_relaxed)) {
+        record(type, seqno, len, value);
+    }
+}
+
+} // namespace trace
+
+#endif // TRACE_H
@@ -1,33 +1,98 @@
 #include "udp-util.h"
 
+#include <algorithm>
+#include <errno.h>
+#include <linux/sock_diag.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <mutex>
-#include <random>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "netem.h"
 
 namespace udp_util {
 
-bool randrop(double plp, double seed) {
-    static std::mutex mtx;
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    if (seed > 0.0) {
-        gen.seed(seed);
+namespace {
+
+/* Kernel bookkeeping per queued datagram (sk_buff, alignment), measured on loopback */
+const int DATAGRAM_OVERHEAD = 1152;
+
+/* UDP gives the memory of datagrams already read back to the receive buffer in
+   batches of a quarter of it, so only 3/4 of the buffer surely takes new ones */
+inline long usable_bytes(const long rcvbuf) {
+    return rcvbuf / 4 * 3;
+}
+
+void enable_rxq_ovfl(udpsocket* s) {
+    int on = 1;
+    s->rxq_ovfl = setsockopt(s->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == 0;
+}
+
+/// Grow one buffer to bytes, the privileged way first. Return its size
+int grow_buffer(const int fd, const int name, const int force_name, const int bytes) {
+    int current = 0;
+    socklen_t len = sizeof(current);
+    getsockopt(fd, SOL_SOCKET, name, &current, &len);
+    if (current < bytes) {
+        /* The kernel doubles the value for its overhead, bytes counts it already */
+        int half = bytes / 2 + 1;
+        if (setsockopt(fd, SOL_SOCKET, force_name, &half, sizeof(half)) < 0) {
+            setsockopt(fd, SOL_SOCKET, name, &half, sizeof(half));
+        }
+        getsockopt(fd, SOL_SOCKET, name, &current, &len);
     }
-    static std::discrete_distribution<> d({1.0 - plp, plp});
-    mtx.lock();
-    int rand_idx = d(gen);
-    mtx.unlock();
-    return rand_idx;
+    return current;
 }
 
+/// recvfrom that also picks up the SO_RXQ_OVFL drop count
+int receive(udpsocket* s, void* buf, const int bufsize, const int flags) {
+    iovec iov = {buf, (size_t) bufsize};
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &s->toaddr;
+    msg.msg_namelen = sizeof(s->toaddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int recved = recvmsg(s->fd, &msg, flags);
+    if (recved < 0) {
+        return recved;
+    }
+    s->addr_len = msg.msg_namelen;
+    /* Only there once the socket has dropped something */
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+            s->drops = drops;
+        }
+    }
+    return recved;
+}
+
+long usec_since(const timespec& t) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t.tv_sec) * 1000000 + (now.tv_nsec - t.tv_nsec) / 1000;
+}
+
+} // namespace
+
 udpsocket create_socket(const int port, const int toport, const int toip) {
     udpsocket s;
     if ((s.fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
         perror("cannot create socket");
-        exit(1);
+        return s;
     }
+    enable_rxq_ovfl(&s);
 
     memset((char*) &s.toaddr, 0, sizeof(s.toaddr));
     s.toaddr.sin_family = AF_INET;
@@ -36,17 +101,18 @@ udpsocket create_socket(const int port, const int toport, const int toip) {
     s.addr_len = sizeof(s.toaddr);
 
     sockaddr_in myaddr;
-    socklen_t myaddr_len = sizeof(myaddr);
     memset((char*) &myaddr, 0, sizeof(myaddr));
     myaddr.sin_family = AF_INET;
     myaddr.sin_port = htons(port);
     myaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    myaddr_len = sizeof(myaddr);
 
     /* bind to the address to which the service will be offered */
     if (bind(s.fd, (sockaddr *) &myaddr, sizeof(myaddr)) < 0) {
+        int bind_errno = errno;
         perror("bind failed");
-        exit(1);
+        close(s.fd);
+        s.fd = -1;
+        errno = bind_errno;
     }
 
     return s;
@@ -56,9 +122,11 @@ udpsocket create_socket(const sockaddr_in toaddr, const socklen_t addr_len) {
     udpsocket s;
     if ((s.fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
         perror("cannot create socket");
-        exit(1);
+        return s;
     }
 
+    enable_rxq_ovfl(&s);
+
     memset((char*) &s.toaddr, 0, sizeof(s.toaddr));
     s.toaddr = toaddr;
     s.addr_len = addr_len;
@@ -66,36 +134,143 @@ udpsocket create_socket(const sockaddr_in toaddr, const socklen_t addr_len) {
     return s;
 }
 
-void set_socket_timeout(const int sockfd, const long timeout) {
+int set_socket_timeout(const int sockfd, const long timeout) {
     struct timeval tv;
     tv.tv_sec = 0;
     tv.tv_usec = timeout;
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
         perror("server: error to set timeout");
-        exit(-1);
+        return -1;
     }
+    return 0;
 }
 
-void reset_socket_timeout(const int sockfd) {
+int reset_socket_timeout(const int sockfd) {
     struct timeval tv;
     tv.tv_sec = 0;
     tv.tv_usec = 0;
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
         perror("server: error to reset timeout");
-        exit(-1);
+        return -1;
     }
+    return 0;
 }
 
 int recvtimed(udpsocket* s, void* buf, const int bufsize, const long t) {
+    if (s->busy_poll) {
+        timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int recved;
+        while ((recved = recv_nowait(s, buf, bufsize)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+               && usec_since(start) < t) {
+            /* Free when the core is idle, and the peer may need it to answer */
+            sched_yield();
+        }
+        return recved;
+    }
     set_socket_timeout(s->fd, t);
-    int recved = recvfrom(s->fd, buf, bufsize, 0, (sockaddr*) &s->toaddr, &s->addr_len);
+    int recved = receive(s, buf, bufsize, 0);
     reset_socket_timeout(s->fd);
     return recved;
 }
 
+int recv_nowait(udpsocket* s, void* buf, const int bufsize) {
+    return receive(s, buf, bufsize, MSG_DONTWAIT);
+}
+
 int send(udpsocket* s, const void* buf, const int bufsize) {
+    if (s->em != nullptr) {
+        return s->em->send(s->fd, buf, bufsize, s->toaddr, s->addr_len);
+    }
     return sendto(s->fd, (void*) buf, bufsize, 0, (sockaddr*) &s->toaddr, s->addr_len);
 }
 
+int send_batch(udpsocket* s, const message* msgs, const int n) {
+    if (s->em != nullptr) {
+        for (int i = 0; i < n; ++i) {
+            s->em->send(s->fd, msgs[i].buf, msgs[i].len, msgs[i].to, sizeof(msgs[i].to));
+        }
+        return n;
+    }
+    std::vector<mmsghdr> hdrs(n);
+    std::vector<iovec> iov(n);
+    for (int i = 0; i < n; ++i) {
+        iov[i].iov_base = (void*) msgs[i].buf;
+        iov[i].iov_len = msgs[i].len;
+        memset(&hdrs[i], 0, sizeof(hdrs[i]));
+        hdrs[i].msg_hdr.msg_name = (void*) &msgs[i].to;
+        hdrs[i].msg_hdr.msg_namelen = sizeof(msgs[i].to);
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(s->fd, hdrs.data() + sent, std::min(n - sent, UIO_MAXIOV), 0);
+        if (r < 0) {
+            perror("error sending batch");
+            return sent > 0 ? sent : -1;
+        }
+        sent += r;
+    }
+    return sent;
+}
+
+int size_buffers(udpsocket* s, const int datagrams, const int size) {
+    int bytes = (int) std::min<long>((long) datagrams * (size + DATAGRAM_OVERHEAD) / 3 * 4 + 4, INT32_MAX / 2);
+    grow_buffer(s->fd, SO_SNDBUF, SO_SNDBUFFORCE, bytes);
+    return usable_bytes(grow_buffer(s->fd, SO_RCVBUF, SO_RCVBUFFORCE, bytes)) / (size + DATAGRAM_OVERHEAD);
+}
+
+int receive_room(const udpsocket* s, const int size) {
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(mem);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0 || len <= SK_MEMINFO_RCVBUF * sizeof(uint32_t)) {
+        return -1;
+    }
+    /* rmem_alloc still counts datagrams read but not given back yet, see usable_bytes() */
+    long room = (long) mem[SK_MEMINFO_RCVBUF] - (long) mem[SK_MEMINFO_RMEM_ALLOC];
+    return (int) (std::max(0L, room) / (size + DATAGRAM_OVERHEAD));
+}
+
+void set_busy_poll(udpsocket* s, const int usec) {
+    if (setsockopt(s->fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+        perror("cannot set SO_BUSY_POLL, polling without it");
+    }
+    s->busy_poll = true;
+}
+
+int busy_poll_from_env() {
+    const char* usec = getenv("RUDP_BUSY_POLL");
+    return usec != NULL ? std::max(0, atoi(usec)) : 0;
+}
+
+long socket_drops(const udpsocket* s) {
+    if (s->rxq_ovfl) {
+        return s->drops;
+    }
+    struct stat st;
+    if (s->fd < 0 || fstat(s->fd, &st) < 0) {
+        return -1;
+    }
+    FILE* fd = fopen("/proc/net/udp", "r");
+    if (fd == NULL) {
+        return -1;
+    }
+    char line[512];
+    long drops = -1;
+    unsigned long inode;
+    long line_drops;
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        /* sl local rem st tx:rx tr:tm retrnsmt uid timeout inode ref pointer drops */
+        if (sscanf(line, " %*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %*s %*s %ld", &inode, &line_drops) == 2
+            && inode == st.st_ino) {
+            drops = line_drops;
+            break;
+        }
+    }
+    fclose(fd);
+    return drops;
+}
+
 } // socket_util
 
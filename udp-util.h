@@ -2,29 +2,94 @@
 #define UDP_UTIL_H
 
 #include <arpa/inet.h>
+#include <atomic>
+#include <cstdint>
 
 namespace udp_util {
 
+class netem;
+
 struct udpsocket {
     int fd;
     sockaddr_in toaddr;
     socklen_t addr_len = sizeof(toaddr);
-};
+    netem* em = nullptr; // network emulator for outgoing datagrams, see netem.h
+    bool rxq_ovfl = false; // the kernel reports its drop count with every datagram
+    std::atomic<uint32_t> drops; // that count as of the last datagram received, the
+                                 // stats exporter reads it while a transfer receives
+    bool busy_poll = false; // recvtimed spins instead of blocking, see set_busy_poll()
 
-bool randrop(double plp = 0.0, double seed = -1.0);
+    udpsocket() : drops(0) {}
+    udpsocket(const udpsocket& s) : fd(s.fd), toaddr(s.toaddr), addr_len(s.addr_len), em(s.em),
+        rxq_ovfl(s.rxq_ovfl), drops(s.drops.load()), busy_poll(s.busy_poll) {}
+    udpsocket& operator=(const udpsocket& s) {
+        fd = s.fd;
+        toaddr = s.toaddr;
+        addr_len = s.addr_len;
+        em = s.em;
+        rxq_ovfl = s.rxq_ovfl;
+        drops = s.drops.load();
+        busy_poll = s.busy_poll;
+        return *this;
+    }
+};
 
+/// Socket bound to port, sending to toip:toport. Its fd is -1 if it cannot be
+/// created or bound, errno says why
 udpsocket create_socket(const int port, const int toport=0, const int toip=INADDR_ANY);
 
+/// Unbound socket sending to toaddr, fd -1 on error
 udpsocket create_socket(const sockaddr_in toaddr, const socklen_t addr_len);
 
-void set_socket_timeout(const int sockfd, const long timeout);
+/// Return 0 or -1 on error
+int set_socket_timeout(const int sockfd, const long timeout);
 
-void reset_socket_timeout(const int sockfd);
+/// Return 0 or -1 on error
+int reset_socket_timeout(const int sockfd);
 
+/// Receive one datagram, waiting at most t microseconds. The sender's address
+/// goes to s->toaddr. Return its size or -1
 int recvtimed(udpsocket* s, void* buf, const int bufsize, const long t);
 
+/// Receive one datagram if one is queued, -1 with errno EAGAIN otherwise
+int recv_nowait(udpsocket* s, void* buf, const int bufsize);
+
 int send(udpsocket* s, const void* buf, const int bufsize);
 
+/// One datagram of a batch, see send_batch()
+struct message {
+    const void* buf;
+    int len;
+    sockaddr_in to;
+};
+
+/// Send the n datagrams with as few system calls as sendmmsg allows, through
+/// the emulator if s has one. Return the number sent or -1
+int send_batch(udpsocket* s, const message* msgs, const int n);
+
+/// Grow the kernel send and receive buffers of s to hold `datagrams` datagrams
+/// of `size` bytes, the kernel's own overhead per datagram included. Buffers
+/// never shrink, and only grow past net.core.rmem_max/wmem_max with
+/// CAP_NET_ADMIN. The receive buffer gets a third more, the kernel only frees
+/// what was read in batches. Return how many such datagrams it surely holds
+int size_buffers(udpsocket* s, const int datagrams, const int size);
+
+/// Datagrams of `size` bytes the receive buffer of s takes right now, counted
+/// like size_buffers(), or -1 if the kernel does not tell (SO_MEMINFO)
+int receive_room(const udpsocket* s, const int size);
+
+/// Low-latency receive for s: SO_BUSY_POLL for usec microseconds, which needs
+/// CAP_NET_ADMIN above net.core.busy_read, and recvtimed polls the socket
+/// without blocking instead of sleeping in the kernel. Costs a core while waiting
+void set_busy_poll(udpsocket* s, const int usec);
+
+/// Busy poll time from $RUDP_BUSY_POLL in microseconds, 0 if not set
+int busy_poll_from_env();
+
+/// Datagrams the kernel dropped for s, from SO_RXQ_OVFL as of the last datagram
+/// received or else from /proc/net/udp, -1 if unknown
+long socket_drops(const udpsocket* s);
+
 } // socket_util
 
 #endif // UDP_UTIL_H
@@ -2,6 +2,10 @@
 #define UTIL_H_INCLUDED
 
 #include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <vector>
 
 template<
     typename T, //real type
@@ -40,4 +44,108 @@ private:
     T s, f;
 };
 
+/// Disjoint [start, end) ranges, touching ones are merged
+template<typename T> class RangeSet {
+public:
+    /// Add [s, f), return how many of its elements were not in the set yet
+    T insert(const T s, const T f) {
+        if (f <= s) {
+            return 0;
+        }
+        T added = f - s, ns = s, nf = f;
+        auto it = ranges.upper_bound(s);
+        if (it != ranges.begin() && std::prev(it)->second >= s) {
+            --it;
+        }
+        while (it != ranges.end() && it->first <= f) {
+            T os = std::max(it->first, s), of = std::min(it->second, f);
+            if (of > os) {
+                added -= of - os;
+            }
+            ns = std::min(ns, it->first);
+            nf = std::max(nf, it->second);
+            it = ranges.erase(it);
+        }
+        ranges[ns] = nf;
+        return added;
+    }
+
+    /// Remove [s, f)
+    void erase(const T s, const T f) {
+        auto it = ranges.upper_bound(s);
+        if (it != ranges.begin()) {
+            --it;
+        }
+        while (it != ranges.end() && it->first < f) {
+            T rs = it->first, rf = it->second;
+            if (rf <= s) {
+                ++it;
+                continue;
+            }
+            it = ranges.erase(it);
+            if (rs < s) ranges[rs] = s;
+            if (rf > f) ranges[f] = rf;
+        }
+    }
+
+    bool contains(const T s, const T f) const {
+        auto it = ranges.upper_bound(s);
+        return it != ranges.begin() && std::prev(it)->first <= s && std::prev(it)->second >= f;
+    }
+
+    /// The parts of [s, f) not in the set
+    std::vector<Range<T>> gaps(const T s, const T f) const {
+        std::vector<Range<T>> v;
+        T pos = s;
+        auto it = ranges.upper_bound(s);
+        if (it != ranges.begin()) {
+            --it;
+        }
+        for (; it != ranges.end() && pos < f; ++it) {
+            if (it->first > pos) {
+                v.push_back(Range<T>(pos, std::min(it->first, f) - pos));
+            }
+            pos = std::max(pos, it->second);
+        }
+        if (pos < f) {
+            v.push_back(Range<T>(pos, f - pos));
+        }
+        return v;
+    }
+
+    inline bool empty() const { return ranges.empty(); }
+    inline Range<T> first() const { return Range<T>(ranges.begin()->first, ranges.begin()->second - ranges.begin()->first); }
+
+private:
+    std::map<T, T> ranges;
+};
+
+/// Sequence numbers are 64-bit byte offsets but only their low 32 bits go on
+/// the wire. Return the offset closest to `expected` whose low 32 bits equal
+/// `truncated`; valid as long as the window is smaller than 2^31 bytes.
+inline uint64_t expand_seqno(const uint64_t expected, const uint32_t truncated) {
+    const uint64_t span = 1ULL << 32;
+    uint64_t candidate = (expected & ~(span - 1)) | truncated;
+    if (candidate + span / 2 <= expected && candidate + span > candidate) {
+        candidate += span;
+    } else if (candidate > expected + span / 2 && candidate >= span) {
+        candidate -= span;
+    }
+    return candidate;
+}
+
+/// expand_seqno() for data that arrives out of order: the offset closest to
+/// `near`, moved into [start, end) if one 2^32 step can do it.
+inline uint64_t expand_seqno_within(const uint64_t start, const uint64_t end, const uint64_t near,
+                                    const uint32_t truncated) {
+    const uint64_t span = 1ULL << 32;
+    uint64_t seqno = expand_seqno(near, truncated);
+    if (seqno >= end && seqno >= span && seqno - span >= start) {
+        seqno -= span;
+    } else if (seqno < start && seqno + span < end) {
+        seqno += span;
+    }
+    return seqno;
+}
+
 #endif // UTIL_H_INCLUDED